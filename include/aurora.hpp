@@ -49,8 +49,14 @@ class Aurora {
             float radius, strength, duration, age;
         };
 
+        // Sample positions, as structure of arrays (spls is only filled for
+        // drawing)
+        AlignedVector<float> pos_x, pos_y;
         AlignedVector<Sample> spls;
-        AlignedVector<dake::math::fvec2> forces;
+
+        // Only used during step()
+        AlignedVector<float> force_x, force_y, strengths;
+
         AlignedVector<CircularForce> circulars;
 };
 
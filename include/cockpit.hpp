@@ -6,6 +6,7 @@
 
 
 void init_cockpit(void);
-void draw_cockpit(const GraphicsStatus &status, const WorldState &world);
+void draw_cockpit(const GraphicsStatus &status, const WorldState &world,
+                  const InterpolatedState &view);
 
 #endif
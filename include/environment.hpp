@@ -6,6 +6,7 @@
 
 
 void init_environment(void);
-void draw_environment(const GraphicsStatus &status, const WorldState &world);
+void draw_environment(const GraphicsStatus &status, const WorldState &world,
+                      const InterpolatedState &view);
 
 #endif
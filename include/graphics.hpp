@@ -29,7 +29,9 @@ void init_game_graphics(void);
 void set_resolution(unsigned width, unsigned height);
 void register_resize_handler(void (*rh)(unsigned w, unsigned h));
 
-void do_graphics(const WorldState &input);
+// Draws a state between previous and current (see interpolate_world_states())
+void do_graphics(const WorldState &previous, const WorldState &current,
+                 float alpha);
 
 
 extern dake::gl::vertex_array *quad_vertices;
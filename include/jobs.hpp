@@ -0,0 +1,63 @@
+#ifndef JOBS_HPP
+#define JOBS_HPP
+
+#include <atomic>
+#include <cstddef>
+#include <functional>
+
+
+// Starts the worker threads. @threads is the total number of threads that
+// should be working on jobs, including the one calling parallel_for() or
+// JobGroup::wait(); 0 means one per CPU core. With 1, everything is run
+// synchronously.
+void init_jobs(int threads);
+
+// Number of distinct values job_slot() may return.
+int job_slot_count(void);
+
+// Returns the index of the calling thread: 0 for any thread that is not a
+// worker (so per-slot data indexed by this must only be used by a single
+// non-worker thread at a time, i.e. the physics thread), 1..n for the workers.
+int job_slot(void);
+
+
+class JobGroup {
+    public:
+        JobGroup(void);
+        ~JobGroup(void);
+
+        JobGroup(const JobGroup &) = delete;
+        JobGroup &operator=(const JobGroup &) = delete;
+
+        // Queues a job that is expected to take not longer than a physics
+        // step. It will be run by any of the workers or by a thread waiting
+        // on any group.
+        void run(const std::function<void(void)> &job);
+
+        // Queues a job that may take arbitrarily long (e.g. loading images
+        // from disk). Only the workers will run such jobs, and only if there
+        // is nothing else to do. Without any workers, a separate thread runs
+        // them, so they never block the caller.
+        void run_background(const std::function<void(void)> &job);
+
+        // Returns true when all jobs submitted to this group are done.
+        bool done(void) const;
+
+        // Waits until all jobs are done, helping with the queued work in the
+        // meantime.
+        void wait(void);
+
+    private:
+        std::atomic<int> pending;
+
+        friend struct Job;
+};
+
+
+// Runs @fn(begin, end) over [0, @count) in chunks of at least @grain
+// elements; the calling thread handles the first chunk itself. Returns once
+// all chunks are done.
+void parallel_for(size_t count, size_t grain,
+                  const std::function<void(size_t begin, size_t end)> &fn);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef KEPLER_HPP
+#define KEPLER_HPP
+
+#include <dake/math/fmatrix.hpp>
+
+
+// A closed orbit around the earth, used for moving ships that are not
+// accelerated by anything but gravity ("on rails") analytically instead of
+// integrating them.
+struct KeplerOrbit {
+    bool valid = false;
+
+    // Unit vectors in the orbital plane, towards the periapsis and 90° ahead
+    // of it (in the direction of movement)
+    dake::math::fvec3d p, q;
+
+    // Semi-major axis (m), eccentricity, mean motion (1/s)
+    double a, e, n;
+    double mean_anomaly;
+
+    // State at the current mean anomaly; as long as a ship's position and
+    // velocity are exactly these, nothing has disturbed it since the last
+    // propagation and the orbit can be used further
+    dake::math::fvec3d position, velocity;
+
+    // Returns false (and leaves the orbit invalid) if the given state is not
+    // on a closed orbit that stays above the earth's surface
+    bool from_state(const dake::math::fvec3d &pos,
+                    const dake::math::fvec3d &vel);
+
+    // Advances the orbit by @dt seconds, updating position and velocity
+    void propagate(double dt);
+
+    bool matches(const dake::math::fvec3d &pos,
+                 const dake::math::fvec3d &vel) const;
+};
+
+#endif
@@ -1,9 +1,33 @@
 #ifndef OPTIONS_HPP
 #define OPTIONS_HPP
 
+#include <cstddef>
+
 struct Options {
     int min_lod = 0, max_lod = 8;
     bool aurora = true;
+    // Number of auroras and of the samples each of them consists of
+    int auroras = 3, aurora_samples = 128;
+
+    // Physics step length in seconds; 0 means variable (one step per frame)
+    float physics_step = 0.f;
+
+    // Threads working on jobs (including the physics thread); 0 means one per
+    // CPU core
+    int job_threads = 0;
+
+    // Maximum number of projectiles in flight; when spawning more, some are
+    // removed early as determined by projectile_eviction
+    size_t max_projectiles = 65536;
+
+    enum ProjectileEviction {
+        // Remove the projectiles that have been flying the longest
+        EVICT_OLDEST,
+        // Remove those farthest away from any ship first
+        EVICT_FARTHEST,
+        // Remove the oldest of those out of any ship's radar range first
+        EVICT_OUT_OF_RANGE,
+    } projectile_eviction = EVICT_OLDEST;
 
     int scratch_map_resolution = 1080;
     bool uniform_scratch_map = false;
@@ -20,4 +44,31 @@ struct Options {
 
 extern Options global_options;
 
+
+// Options understood by both g1 and g1-sim; COMMON_LONG_OPTIONS goes into their
+// getopt_long() option lists
+enum CommonOption {
+    OPT_THREADS = 512,
+    OPT_MAX_PROJECTILES,
+    OPT_PROJECTILE_EVICTION,
+    OPT_DISABLE_AURORA,
+    OPT_AURORAS,
+    OPT_AURORA_SAMPLES,
+};
+
+#define COMMON_LONG_OPTIONS \
+    {"threads", required_argument, nullptr, OPT_THREADS}, \
+    {"max-projectiles", required_argument, nullptr, OPT_MAX_PROJECTILES}, \
+    {"projectile-eviction", required_argument, nullptr, \
+     OPT_PROJECTILE_EVICTION}, \
+    {"disable-aurora", no_argument, nullptr, OPT_DISABLE_AURORA}, \
+    {"auroras", required_argument, nullptr, OPT_AURORAS}, \
+    {"aurora-samples", required_argument, nullptr, OPT_AURORA_SAMPLES}
+
+// Applies @opt (one of CommonOption) with its argument @arg to global_options.
+// Prints an error and returns false if @arg is invalid.
+bool parse_common_option(int opt, const char *arg);
+
+void print_common_options_help(void);
+
 #endif
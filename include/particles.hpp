@@ -4,9 +4,12 @@
 #include <dake/math/matrix.hpp>
 #include <dake/math/fmatrix.hpp>
 
+#include <cstddef>
+#include <cstdint>
 #include <vector>
 
 #include "align-allocator.hpp"
+#include "json-structs.hpp"
 
 
 struct ParticleGraphicsData {
@@ -14,11 +17,33 @@ struct ParticleGraphicsData {
     dake::math::vec3 orientation;
 };
 
+// Structure of arrays, so particles can be moved with SIMD
 struct ParticleNonGraphicsData {
-    dake::math::fvec3d position;
-    dake::math::fvec3 velocity;
-    float lifetime;
-    uint64_t source_ship_id;
+    void resize(size_t count);
+    void reserve(size_t count);
+
+    void push_back(const dake::math::fvec3d &position,
+                   const dake::math::fvec3 &velocity,
+                   float lifetime_s, uint64_t source,
+                   const WeaponClass *weapon);
+
+    size_t size(void) const { return lifetime.size(); }
+
+    dake::math::fvec3d position(size_t i) const
+    {
+        return dake::math::fvec3d(pos_x[i], pos_y[i], pos_z[i]);
+    }
+
+    dake::math::fvec3 velocity(size_t i) const
+    {
+        return dake::math::fvec3(vel_x[i], vel_y[i], vel_z[i]);
+    }
+
+    AlignedVector<double> pos_x, pos_y, pos_z;
+    AlignedVector<float> vel_x, vel_y, vel_z;
+    AlignedVector<float> lifetime;
+    AlignedVector<uint64_t> source_ship_id;
+    AlignedVector<const WeaponClass *> weapon_class;
 };
 
 struct ImpactGraphicsData {
@@ -32,9 +57,20 @@ struct ImpactNonGraphicsData {
 };
 
 
+// A projectile having hit a ship
+struct HitEvent {
+    uint64_t source_ship_id, target_ship_id;
+    dake::math::fvec3d position;
+    const WeaponClass *weapon;
+};
+
+
 struct Particles {
     AlignedVector<ParticleGraphicsData> pgd;
-    AlignedVector<ParticleNonGraphicsData> pngd;
+    ParticleNonGraphicsData pngd;
+    // Upper bound for the speed (in m/s) of the particles in pngd, kept up to
+    // date by move_particles() and handle_particles()
+    float max_speed = 0.f;
 
     AlignedVector<ImpactGraphicsData> igd;
     AlignedVector<ImpactNonGraphicsData> ingd;
@@ -42,20 +78,36 @@ struct Particles {
 
 
 struct WorldState;
+struct InterpolatedState;
 struct GraphicsStatus;
 struct ShipState;
+class SpatialGrid;
 
 
 void init_particles(void);
 
+// The particle's lifetime and what it does on impact are taken from @weapon
 void spawn_particle(WorldState &output, const ShipState &sender,
+                    const WeaponClass *weapon,
                     const dake::math::fvec3d &position,
                     const dake::math::fvec3 &velocity,
                     const dake::math::fvec3 &orientation);
 
-void handle_particles(Particles &output, const Particles &input,
-                      WorldState &out_ws, const ShipState &player);
-
-void draw_particles(const GraphicsStatus &state, const Particles &input);
+// Moves all particles and impacts from @input to @output and drops those that
+// have expired.  Does not touch any ship (other than reading @player), so it
+// can run while the other ships are stepped.
+void move_particles(Particles &output, const Particles &input,
+                    const WorldState &out_ws, const ShipState &player);
+
+// Adds the particles spawned during this step to @output (which must have
+// gone through move_particles() before) and lets them hit ships.  All hits are
+// collected first (in parallel) and then applied in a single pass, in the
+// order in which they are recorded in @out_ws.hit_events.  @range_grid must
+// have been built over out_ws.ships with a cell size of RADAR_RANGE.
+void handle_particles(Particles &output, WorldState &out_ws,
+                      const ShipState &player, const SpatialGrid &range_grid);
+
+void draw_particles(const GraphicsStatus &state,
+                    const InterpolatedState &input);
 
 #endif
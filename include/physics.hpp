@@ -4,6 +4,7 @@
 #include <dake/math/fmatrix.hpp>
 
 #include <chrono>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -11,17 +12,34 @@
 #include "aurora.hpp"
 #include "json-structs.hpp"
 #include "particles.hpp"
+#include "radar.hpp"
 #include "ship.hpp"
 #include "software.hpp"
 #include "ui.hpp"
 
 
 struct WorldState {
-    void initialize(const std::string &scenario);
+    void initialize(const std::string &scenario,
+                    std::chrono::system_clock::time_point start =
+                        std::chrono::system_clock::now());
 
+    // Spawning and despawning ships are O(1) and never move other ships
     ShipState &spawn_ship(const Ship *type);
+    void despawn_ship(size_t slot);
 
-    std::chrono::system_clock::time_point timestamp, real_timestamp;
+    // Return nullptr if the ship does not exist (anymore)
+    ShipState *ship_by_id(uint64_t id);
+    const ShipState *ship_by_id(uint64_t id) const;
+
+    // Makes every slot of the ship list (and of the tables indexed like it)
+    // hold the same ship as in @input, copying only the slots that differ
+    void sync_ship_layout(const WorldState &input);
+
+    // In-game date and time
+    std::chrono::system_clock::time_point timestamp;
+    // Simulated time since initialization in seconds, excluding time
+    // acceleration (that is, the sum of all real_interval values)
+    double sim_time;
     float interval, real_interval;
     int time_speed_up;
 
@@ -32,9 +50,22 @@ struct WorldState {
 
     dake::math::fmat4 earth_mv, earth_inv_mv;
 
+    // Slot map: Every entry is either a live ship or a free slot (with alive
+    // set to false), whose index is then in free_ship_slots
     AlignedVector<ShipState> ships;
+    std::vector<uint32_t> free_ship_slots;
+    // Same size as ships, holds their positions, velocities, angular momenta
+    // and orientations
+    ShipTable ship_table;
+    // Same size as ships as well; what a ship only needs for its own step (and
+    // the UI for the player's), kept apart so that stepping or syncing the
+    // ship list does not drag it through the cache
+    std::vector<ShipEquipment> ship_equipment;
+    std::vector<Radar> radars;
     int player_ship;
-    bool ship_list_changed;
+    // Incremented whenever ships are added or removed; if it is the same for
+    // two states, their ship lists match up
+    uint64_t ship_list_generation = 0;
 
     std::vector<Aurora> auroras;
     Aurora::HotspotList aurora_hotspots;
@@ -42,11 +73,72 @@ struct WorldState {
     Software *scenario;
     bool scenario_initialized;
 
-    Particles particles, new_particles;
+    Particles particles;
+    // Particles spawned during this step, one list per job slot (see
+    // job_slot()) so ships can fire in parallel; merged into the above by
+    // handle_particles()
+    std::vector<Particles> new_particles;
+    // All projectile hits during this step, already applied to the ships
+    std::vector<HitEvent> hit_events;
+};
+
+
+// The part of the world that is drawn, at some point between two physics
+// steps (see interpolate_world_states()); everything else is drawn straight
+// from the current state
+struct InterpolatedState {
+    float interval, real_interval;
+
+    // Simulated time from this point to the current state; radar contacts
+    // (which are relative to the player) are moved back by this along their
+    // relative velocity when drawn
+    float back;
+
+    dake::math::fmat4 earth_mv;
+
+    // The player's ship
+    dake::math::fvec3d position, velocity;
+    dake::math::fvec3 forward, up, right;
+
+    AlignedVector<ParticleGraphicsData> pgd;
+    AlignedVector<ImpactGraphicsData> igd;
 };
 
 
-void do_physics(WorldState &output, const WorldState &input, const Input &user_input);
+// Decides when to run physics steps and how long they are.  With a step length
+// of 0, every tick() results in a single step as long as the wall-clock time
+// elapsed since the last tick (but no more than .1 s).  Otherwise, the elapsed
+// time is accumulated and as many fixed-length steps as fit are run.
+class PhysicsClock {
+    public:
+        PhysicsClock(float step_length);
+
+        // Returns the number of steps to run now
+        int tick(void);
+
+        float step_length(void) const { return cur_step; }
+
+        // Wall-clock time (in seconds) until the next step is due
+        float time_to_next_step(void) const;
+
+    private:
+        std::chrono::steady_clock::time_point last_tick;
+        float fixed_step, cur_step, accumulator = 0.f;
+};
+
+
+// real_interval is the length of the step, not accounting for time acceleration
+void do_physics(WorldState &output, const WorldState &input,
+                const Input &user_input, float real_interval);
+
+// Fills @output with what is to be drawn between two consecutive states
+// (alpha 0: previous, alpha 1: current); its intervals are set according to
+// the given real_interval, which should be the time elapsed since the last
+// frame
+void interpolate_world_states(InterpolatedState &output,
+                              const WorldState &previous,
+                              const WorldState &current, float alpha,
+                              float real_interval);
 
 void enable_player_physics(bool state);
 void fix_player_to_ground(bool state);
@@ -10,6 +10,12 @@
 struct WorldState;
 struct ShipState;
 struct Input;
+class SpatialGrid;
+
+
+// Ships farther away than this (in meters) cannot be seen; also the cell size
+// of the grid passed to Radar::update()
+#define RADAR_RANGE 1e6f
 
 
 struct RadarTarget {
@@ -26,13 +32,23 @@ struct RadarTarget {
 
 class Radar {
     public:
+        // @grid must have been built over ws_new.ships with a cell size of
+        // RADAR_RANGE
         void update(const Radar &radar_old, const ShipState &ship_new,
-                    const WorldState &ws_new, const Input &user_input);
+                    const WorldState &ws_new, const SpatialGrid &grid,
+                    const Input &user_input);
 
         std::vector<RadarTarget> targets;
 
+        // Where the antenna is pointing, as a fraction of a full turn around
+        // the ship's up axis (0 is straight ahead, then turning right).
+        // Every step, only contacts in the sector covered since the last one
+        // are refreshed (the antenna makes Ship::radar_scan_rate turns per
+        // second; if that is not given, all contacts are refreshed every
+        // step).
+        float sweep = 0.f;
+
         uint64_t selected_id = (uint64_t)-1;
-        RadarTarget *selected = nullptr;
 };
 
 #endif
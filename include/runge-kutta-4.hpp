@@ -2,7 +2,9 @@
 #define RUNGE_KUTTA_4_HPP
 
 #include <dake/math/fmatrix.hpp>
-#include <functional>
+
+#include <cmath>
+#include <cstddef>
 
 
 struct RK4State {
@@ -15,10 +17,95 @@ struct RK4State {
 };
 
 
-typedef std::function<dake::math::fvec3(const RK4State &state)>
-        RK4CalcAccelerationFunc;
+struct RK4Increments {
+    RK4Increments(void):
+        dx(dake::math::fvec3d::zero()), dv(dake::math::fvec3d::zero())
+    {}
+
+    RK4Increments(const dake::math::fvec3d &dxdt,
+                  const dake::math::fvec3d &dvdt):
+        dx(dxdt), dv(dvdt)
+    {}
+
+    dake::math::fvec3d dx, dv;
+};
+
+
+template<typename CalcAccel>
+static inline RK4Increments rk4_evaluate(const RK4State &initial, double dt,
+                                         const RK4Increments &d,
+                                         const CalcAccel &calc_accel)
+{
+    RK4State state(initial.x + d.dx * dt,
+                   initial.v + d.dv * dt);
+
+    return RK4Increments(state.v, calc_accel(state));
+}
+
+
+// @calc_accel is any functor taking an RK4State and returning the acceleration
+// (as an fvec3d); being a template parameter, it can be inlined.
+template<typename CalcAccel>
+static inline RK4State rk4_integrate(const RK4State &initial, float dt,
+                                     const CalcAccel &calc_accel)
+{
+    double h = .5 * dt;
+
+    RK4Increments k1 = rk4_evaluate(initial, 0., RK4Increments(), calc_accel);
+    RK4Increments k2 = rk4_evaluate(initial, h,  k1, calc_accel);
+    RK4Increments k3 = rk4_evaluate(initial, h,  k2, calc_accel);
+    RK4Increments k4 = rk4_evaluate(initial, dt, k3, calc_accel);
+
+    dake::math::fvec3d dx = (k1.dx + 2. * (k2.dx + k3.dx) + k4.dx) * (1. / 6.);
+    dake::math::fvec3d dv = (k1.dv + 2. * (k2.dv + k3.dv) + k4.dv) * (1. / 6.);
+
+    return RK4State(initial.x + dx * static_cast<double>(dt),
+                    initial.v + dv * static_cast<double>(dt));
+}
+
+
+#define EARTH_GM     (6.67384e-11 * 5.974e24)
+#define EARTH_RADIUS 6371e3
+
+// The earth's gravity (only above its surface) plus a constant acceleration
+struct RK4EarthGravity {
+    RK4EarthGravity(const dake::math::fvec3d &constant_accel):
+        accel(constant_accel)
+    {}
+
+    dake::math::fvec3d operator()(const RK4State &state) const
+    {
+        double r2 = state.x.dot(state.x);
+        if (r2 <= EARTH_RADIUS * EARTH_RADIUS) {
+            return accel;
+        }
+
+        return accel - state.x * (EARTH_GM / (r2 * sqrt(r2)));
+    }
+
+    dake::math::fvec3d accel;
+};
+
+
+// A number of bodies as structure of arrays, integrated in place
+struct RK4Batch {
+    double *pos_x, *pos_y, *pos_z;
+    double *vel_x, *vel_y, *vel_z;
+
+    // Constant (i.e. non-gravitational) acceleration
+    const float *acc_x, *acc_y, *acc_z;
+};
+
+// Integrates the first @count bodies of @batch with RK4EarthGravity, using AVX
+// for four bodies at once if available.
+void rk4_integrate_earth_gravity(const RK4Batch &batch, size_t count,
+                                 float dt);
 
-RK4State rk4_integrate(const RK4State &initial, float dt,
-                       RK4CalcAccelerationFunc calc_accel);
+// Same as rk4_integrate_earth_gravity(), but uses the Dormand–Prince 5(4)
+// method, splitting @dt into as many substeps per body as necessary to keep
+// the estimated error in bounds.  Slower than RK4 for short intervals, but
+// stays accurate and cheap for long ones (i.e. under time acceleration).
+void dopri5_integrate_earth_gravity(const RK4Batch &batch, size_t count,
+                                    float dt);
 
 #endif
@@ -3,29 +3,57 @@
 
 #include <dake/math/fmatrix.hpp>
 
+#include <cstdint>
+#include <vector>
+
 #include "align-allocator.hpp"
 #include "json-structs.hpp"
-#include "radar.hpp"
+#include "kepler.hpp"
+
+
+// Ship IDs double as handles into WorldState::ships: The lower 32 bits are the
+// slot index, the upper 32 bits count how often that slot has been reused, so
+// an ID never refers to a different ship than the one it was created for.
+static inline uint64_t make_ship_id(uint32_t slot, uint32_t generation)
+{
+    return (static_cast<uint64_t>(generation) << 32) | slot;
+}
+
+static inline uint32_t ship_id_slot(uint64_t id)
+{
+    return static_cast<uint32_t>(id);
+}
+
+static inline uint32_t ship_id_generation(uint64_t id)
+{
+    return static_cast<uint32_t>(id >> 32);
+}
 
 
 struct ShipState {
-    ShipState(const Ship *ship_type);
+    ShipState(const Ship *ship_type, uint64_t ship_id);
 
     void deal_damage(float amount);
 
     const Ship *ship;
 
     uint64_t id;
+    // false if this slot is free (see WorldState::despawn_ship())
+    bool alive;
+
+    // Position, velocity, angular momentum and orientation are kept in
+    // WorldState::ship_table, at this ship's slot (see ship_id_slot());
+    // thruster and weapon states in WorldState::ship_equipment and the radar
+    // in WorldState::radars, at the same index
 
-    // position in km, velocity in m/s, acceleration in m/s^2
-    dake::math::fvec3d position, velocity;
+    // acceleration in m/s^2
     dake::math::fvec3 acceleration;
-    // rotational_velocity in 1/s, angular_momentum in kg*m^2/s, torque in kg*m^2/s^2 (Nm)
-    dake::math::fvec3 rotational_velocity, angular_momentum, torque;
-    // normalized
-    dake::math::fvec3 forward, up, right;
+    // rotational_velocity in 1/s, torque in kg*m^2/s^2 (Nm)
+    dake::math::fvec3 rotational_velocity, torque;
 
     dake::math::fvec3 orbit_normal;
+    // Used instead of integration while nothing but gravity acts on the ship
+    KeplerOrbit orbit;
 
     // Can only be applied during the next frame
     dake::math::fvec3 weapon_force, weapon_torque;
@@ -37,14 +65,131 @@ struct ShipState {
     // kg
     float total_mass;
 
+    float hull_hitpoints;
+};
+
+
+// The state of a ship's thrusters and weapons.  Only the flight control
+// software, the ship's own step and the UI need it, so it is kept out of
+// ShipState (see WorldState::ship_equipment).
+struct ShipEquipment {
+    ShipEquipment(const Ship *ship_type);
+
     std::vector<float> thruster_states;
     std::vector<float> weapon_cooldowns;
     std::vector<bool> weapon_fired;
     AlignedVector<dake::math::fvec3> weapon_forwards;
+};
 
-    Radar radar;
 
-    float hull_hitpoints;
+// The data needed for integrating the ships' movement, with one array per
+// component so the integration can run as a tight loop; index i corresponds to
+// WorldState::ships[i].  This is where the ships' position, velocity, angular
+// momentum and orientation live; the other arrays are filled at the beginning
+// of each step and only serve the integration.
+struct ShipTable {
+    void resize(size_t count);
+
+    size_t size(void) const { return mass.size(); }
+
+    dake::math::fvec3d position(size_t i) const
+    {
+        return dake::math::fvec3d(pos_x[i], pos_y[i], pos_z[i]);
+    }
+
+    dake::math::fvec3d velocity(size_t i) const
+    {
+        return dake::math::fvec3d(vel_x[i], vel_y[i], vel_z[i]);
+    }
+
+    dake::math::fvec3 angular_momentum(size_t i) const
+    {
+        return dake::math::fvec3(ang_mom_x[i], ang_mom_y[i], ang_mom_z[i]);
+    }
+
+    dake::math::fvec3 forward(size_t i) const
+    {
+        return dake::math::fvec3(fwd_x[i], fwd_y[i], fwd_z[i]);
+    }
+
+    dake::math::fvec3 up(size_t i) const
+    {
+        return dake::math::fvec3(up_x[i], up_y[i], up_z[i]);
+    }
+
+    dake::math::fvec3 right(size_t i) const
+    {
+        return dake::math::fvec3(right_x[i], right_y[i], right_z[i]);
+    }
+
+    // Transforms from the ship's local space into world space (positive Z is
+    // backwards)
+    dake::math::fmat3 local_matrix(size_t i) const
+    {
+        return dake::math::fmat3(right(i), up(i), -forward(i));
+    }
+
+    void set_position(size_t i, const dake::math::fvec3d &p)
+    {
+        pos_x[i] = p.x();
+        pos_y[i] = p.y();
+        pos_z[i] = p.z();
+    }
+
+    void set_velocity(size_t i, const dake::math::fvec3d &v)
+    {
+        vel_x[i] = v.x();
+        vel_y[i] = v.y();
+        vel_z[i] = v.z();
+    }
+
+    void set_angular_momentum(size_t i, const dake::math::fvec3 &l)
+    {
+        ang_mom_x[i] = l.x();
+        ang_mom_y[i] = l.y();
+        ang_mom_z[i] = l.z();
+    }
+
+    void set_orientation(size_t i, const dake::math::fvec3 &fwd,
+                         const dake::math::fvec3 &u,
+                         const dake::math::fvec3 &r)
+    {
+        fwd_x[i] = fwd.x();
+        fwd_y[i] = fwd.y();
+        fwd_z[i] = fwd.z();
+
+        up_x[i] = u.x();
+        up_y[i] = u.y();
+        up_z[i] = u.z();
+
+        right_x[i] = r.x();
+        right_y[i] = r.y();
+        right_z[i] = r.z();
+    }
+
+    // Copies position, velocity, angular momentum and orientation of slot @i
+    // from @other
+    void copy_state(size_t i, const ShipTable &other);
+
+    // position in m, velocity in m/s, angular momentum in kg*m^2/s
+    AlignedVector<double> pos_x, pos_y, pos_z;
+    AlignedVector<double> vel_x, vel_y, vel_z;
+    AlignedVector<float> ang_mom_x, ang_mom_y, ang_mom_z;
+    // Orientation (normalized)
+    AlignedVector<float> fwd_x, fwd_y, fwd_z;
+    AlignedVector<float> up_x, up_y, up_z;
+    AlignedVector<float> right_x, right_y, right_z;
+
+    // Acceleration from thrusters and weapons (i.e. without gravity), and
+    // torque
+    AlignedVector<float> acc_x, acc_y, acc_z;
+    AlignedVector<float> torque_x, torque_y, torque_z;
+
+    AlignedVector<float> mass;
+
+    // Non-zero for ships that are moved along their KeplerOrbit instead of
+    // being integrated, and for free slots (which are not moved at all)
+    AlignedVector<uint8_t> on_rails;
 };
 
 #endif
@@ -7,6 +7,10 @@
 #include "json-structs.hpp"
 
 
+// Meters, used if a Ship does not specify a hitbox_radius
+#define DEFAULT_HITBOX_RADIUS 1.f
+
+
 extern std::unordered_map<std::string, const Ship *> ship_types;
 
 
@@ -64,7 +64,10 @@ class FlightControlSoftware: public SpecializedSoftware {
         {}
 
     public:
-        void execute(ShipState &ship, const Input &input, float interval);
+        // Reads the ship's state from ship_in and writes the resulting
+        // thruster states to equipment_out
+        void execute(ShipEquipment &equipment_out, const ShipState &ship_in,
+                     const Input &input, float interval);
 
         friend class Software;
 };
@@ -89,7 +92,7 @@ class ScenarioScript: public SpecializedSoftware {
         static int luaw_player_ship(lua_State *ls);
         static int luaw_spawn_ship(lua_State *ls);
 
-        void lua_pushship(ShipState *ss);
+        void lua_pushship(const ShipState *ss);
 
     public:
         void execute(WorldState &out_world, const WorldState &in_world, const Input &input);
@@ -103,8 +106,9 @@ template<> ScenarioScript &Software::sub<ScenarioScript>(void);
 
 void load_software(void);
 
-void execute_flight_control_software(ShipState &ship, const Input &input,
-                                     float interval);
+void execute_flight_control_software(ShipEquipment &equipment_out,
+                                     const ShipState &ship_in,
+                                     const Input &input, float interval);
 
 Software *get_scenario(const std::string &name);
 
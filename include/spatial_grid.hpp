@@ -0,0 +1,71 @@
+#ifndef SPATIAL_GRID_HPP
+#define SPATIAL_GRID_HPP
+
+#include <dake/math/fmatrix.hpp>
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "align-allocator.hpp"
+
+
+struct ShipState;
+struct ShipTable;
+
+
+// Uniform grid over the ship positions, stored as a hash table of the
+// non-empty cells; rebuilt from scratch every step.
+class SpatialGrid {
+    public:
+        // Indexes all live ships in @ships (by their index in it), at their
+        // positions in @table
+        void build(const AlignedVector<ShipState> &ships,
+                   const ShipTable &table, double cell_size);
+
+        // Appends the indices of all ships in cells overlapping the box
+        // [@min, @max] to @result.  Returns false (and leaves @result alone)
+        // if the box covers more than @max_cells cells, in which case simply
+        // checking all ships is probably cheaper.
+        bool query(const dake::math::fvec3d &min,
+                   const dake::math::fvec3d &max,
+                   std::vector<uint32_t> *result,
+                   size_t max_cells = 64) const;
+
+        // Appends the indices of all ships in cells a sphere of radius
+        // @radius moving from @p0 to @p1 may overlap to @result, each only
+        // once.  Segments longer than a cell are walked in pieces, so the
+        // cost grows with the segment's length instead of with the volume of
+        // its bounding box.  @radius must not exceed half the cell size.
+        void query_segment(const dake::math::fvec3d &p0,
+                           const dake::math::fvec3d &p1, double radius,
+                           std::vector<uint32_t> *result) const;
+
+        double cell_size(void) const { return cell_sz; }
+
+    private:
+        struct Cell {
+            uint64_t key;
+            // Range in ship_indices
+            uint32_t begin, end;
+        };
+
+        int64_t cell_coord(double x) const;
+        const Cell *find(uint64_t key) const;
+        void collect(int64_t x0, int64_t x1, int64_t y0, int64_t y1,
+                     int64_t z0, int64_t z1,
+                     std::vector<uint32_t> *result) const;
+
+        double cell_sz = 1.;
+
+        // (key, ship index), sorted
+        std::vector<std::pair<uint64_t, uint32_t>> entries;
+        std::vector<uint32_t> ship_indices;
+
+        // Open addressing, size is a power of two
+        std::vector<Cell> cells;
+        unsigned cell_shift;
+};
+
+#endif
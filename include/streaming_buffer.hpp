@@ -0,0 +1,78 @@
+#ifndef STREAMING_BUFFER_HPP
+#define STREAMING_BUFFER_HPP
+
+#include <dake/gl.hpp>
+
+#include <cstddef>
+#include <vector>
+
+
+// Number of frames whose vertex data may be in use by the GPU at once
+#define STREAMING_BUFFER_SLOTS 3
+
+
+// Vertex buffer for data that is written anew every frame.  It is split into
+// one slot per frame in flight; everything written during a frame goes into
+// that frame's slot, and a slot is only reused once the GPU is done with it,
+// so writing never has to wait for the GPU.
+//
+// If possible (GL 4.4 or ARB_buffer_storage), the buffer is mapped
+// persistently and a fence is placed after every frame to know when its slot
+// is free again.  Otherwise, the slots are mapped unsynchronized one by one,
+// and the buffer is orphaned whenever the first slot comes around again.
+class StreamingBuffer {
+    public:
+        // @element_size is the size of a single vertex; @initial_capacity is
+        // the number of vertices per frame to allocate for (more will be
+        // allocated when needed)
+        StreamingBuffer(size_t element_size, size_t initial_capacity);
+        ~StreamingBuffer(void);
+
+        StreamingBuffer(const StreamingBuffer &) = delete;
+        StreamingBuffer &operator=(const StreamingBuffer &) = delete;
+
+        // Vertex attribute @index consists of @components values of @type at
+        // @offset in each vertex.  Integer types are passed as integers.
+        void attrib(GLuint index, int components, GLenum type, size_t offset);
+
+        // Returns memory to write up to @max_count vertices to.  Only one
+        // mapping may be active at a time.
+        void *map(size_t max_count);
+
+        // Ends the mapping, with the first @count vertices having been written.
+        // Returns the index of the first of them, for draw().
+        size_t unmap(size_t count);
+
+        void draw(GLenum mode, size_t first, size_t count);
+
+        // Must be called once all draw calls for a frame have been issued
+        static void end_frame(void);
+
+    private:
+        struct Attrib {
+            GLuint index;
+            int components;
+            GLenum type;
+            size_t offset;
+        };
+
+        void allocate(size_t capacity);
+        void next_slot(void);
+
+        size_t element_size;
+
+        // In vertices
+        size_t slot_capacity, slot_used = 0;
+        int slot = 0;
+
+        GLuint buffer = 0, vao = 0;
+        bool persistent;
+
+        // For persistent mappings: The whole buffer
+        void *mapping = nullptr;
+        GLsync fences[STREAMING_BUFFER_SLOTS] = {};
+
+        std::vector<Attrib> attribs;
+};
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef SWEEP_AND_PRUNE_HPP
+#define SWEEP_AND_PRUNE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "align-allocator.hpp"
+
+
+struct ShipState;
+struct ShipTable;
+
+
+// Broadphase for ship-ship contacts: The ships' bounding boxes are kept sorted
+// by their lower end along the X axis.  The order is kept from one step to the
+// next and only repaired by insertion sort, which is close to linear as long
+// as the ships do not move much relative to each other.
+class SweepAndPrune {
+    public:
+        // Brings the list up to date with @ships (adding and removing ships as
+        // needed) and appends the indices of all pairs of live ships whose
+        // hitboxes' bounding boxes overlap to @pairs (lower index first);
+        // @table holds the ships' positions
+        void update(const AlignedVector<ShipState> &ships,
+                    const ShipTable &table,
+                    std::vector<std::pair<uint32_t, uint32_t>> *pairs);
+
+    private:
+        struct Entry {
+            // Along the X axis
+            double min, max;
+            uint32_t ship;
+        };
+
+        void sync(const AlignedVector<ShipState> &ships);
+
+        std::vector<Entry> entries;
+
+        // Per ship slot: The ID of the ship for which there is an entry (or
+        // NO_SHIP)
+        std::vector<uint64_t> listed_ids;
+};
+
+#endif
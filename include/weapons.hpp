@@ -6,6 +6,13 @@
 #include "json-structs.hpp"
 
 
+// Seconds, used if a WeaponClass does not specify a projectile_lifetime
+#define DEFAULT_PROJECTILE_LIFETIME 120.f
+
+// Hull hitpoints, used if a WeaponClass does not specify its damage
+#define DEFAULT_PROJECTILE_DAMAGE 10.f
+
+
 extern std::vector<const WeaponClass *> weapon_classes;
 
 
@@ -1,8 +1,15 @@
 #include <dake/dake.hpp>
 
+#include <algorithm>
+#include <cmath>
 #include <random>
 
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
 #include "aurora.hpp"
+#include "options.hpp"
 #include "physics.hpp"
 
 
@@ -12,15 +19,24 @@ using namespace dake::math;
 
 Aurora::Aurora(void)
 {
-    spls.resize(128);
-    forces.resize(128);
+    size_t count = global_options.aurora_samples;
+
+    pos_x.resize(count);
+    pos_y.resize(count);
+    spls.resize(count);
+
+    force_x.resize(count);
+    force_y.resize(count);
+    strengths.resize(count);
 
     std::default_random_engine rng((uintptr_t)this);
     std::uniform_real_distribution<float> rng_dist(0.f, 1.f);
 
-    for (size_t i = 0; i < spls.size(); i++) {
-        spls[i].position.x() = 2.f * M_PIf * i / spls.size();
-        spls[i].position.y() = (2.5f * rng_dist(rng) + 17.5f) / 180.f * M_PIf;
+    for (size_t i = 0; i < count; i++) {
+        pos_x[i] = 2.f * M_PIf * i / count;
+        pos_y[i] = (2.5f * rng_dist(rng) + 17.5f) / 180.f * M_PIf;
+
+        spls[i].position = vec2(pos_x[i], pos_y[i]);
         spls[i].texcoord = 0.f;
         spls[i].strength = 0.f;
     }
@@ -36,16 +52,232 @@ static float smallest_angle(float x)
 }
 
 
+// e^x, good enough for |x| <= 4: e^(x/8) by its Taylor series, then squared
+// three times
+static inline float small_exp(float x)
+{
+    float y = x * .125f;
+    float r = 1.f + y * (1.f + y * (1.f / 2.f + y * (1.f / 6.f +
+              y * (1.f / 24.f + y * (1.f / 120.f + y * (1.f / 720.f +
+              y * (1.f / 5040.f)))))));
+
+    r *= r;
+    r *= r;
+    return r * r;
+}
+
+
+#ifdef __AVX__
+// Same as smallest_angle(), but without fmodf() (fine as long as the angles
+// stay small)
+static inline __m256 smallest_angle(__m256 x)
+{
+    __m256 turns = _mm256_round_ps(_mm256_mul_ps(x,
+                                                 _mm256_set1_ps(.5f / M_PIf)),
+                                   _MM_FROUND_TO_NEAREST_INT |
+                                   _MM_FROUND_NO_EXC);
+
+    return _mm256_sub_ps(x, _mm256_mul_ps(turns,
+                                          _mm256_set1_ps(2.f * M_PIf)));
+}
+
+
+static inline __m256 small_exp(__m256 x)
+{
+    static const float coeffs[] = {
+        1.f / 5040.f, 1.f / 720.f, 1.f / 120.f, 1.f / 24.f, 1.f / 6.f,
+        1.f / 2.f, 1.f, 1.f
+    };
+
+    __m256 y = _mm256_mul_ps(x, _mm256_set1_ps(.125f));
+    __m256 r = _mm256_set1_ps(coeffs[0]);
+    for (int i = 1; i < 8; i++) {
+        r = _mm256_add_ps(_mm256_mul_ps(r, y), _mm256_set1_ps(coeffs[i]));
+    }
+
+    r = _mm256_mul_ps(r, r);
+    r = _mm256_mul_ps(r, r);
+    return _mm256_mul_ps(r, r);
+}
+#endif
+
+
+// Adds the force a vortex around @center exerts on the samples at (@px, @py)
+// to (@fx, @fy).  @strength is its strength scaled by 1 / @radius.
+static void apply_circular_force(const float *px, const float *py,
+                                 float *fx, float *fy, size_t count,
+                                 const fvec2 &center, float radius,
+                                 float strength)
+{
+    // The force is perpendicular to the direction d from the center, with a
+    // magnitude of strength * radius * rel_dist * e^(-4 * rel_dist); as
+    // rel_dist = |d| / radius, that is strength * e^(-4 * rel_dist) * |d|.
+    size_t i = 0;
+    float inv_radius = 1.f / radius;
+
+#ifdef __AVX__
+    __m256 cx = _mm256_set1_ps(center.x()), cy = _mm256_set1_ps(center.y());
+    __m256 vinv_radius = _mm256_set1_ps(inv_radius);
+    __m256 vstrength = _mm256_set1_ps(strength);
+    __m256 one = _mm256_set1_ps(1.f), minus_four = _mm256_set1_ps(-4.f);
+
+    for (; i + 8 <= count; i += 8) {
+        __m256 dx = smallest_angle(_mm256_sub_ps(_mm256_loadu_ps(&px[i]), cx));
+        __m256 dy = smallest_angle(_mm256_sub_ps(_mm256_loadu_ps(&py[i]), cy));
+
+        __m256 rel_dist = _mm256_mul_ps(_mm256_sqrt_ps(
+                              _mm256_add_ps(_mm256_mul_ps(dx, dx),
+                                            _mm256_mul_ps(dy, dy))),
+                              vinv_radius);
+        __m256 in_range = _mm256_cmp_ps(rel_dist, one, _CMP_LE_OQ);
+
+        __m256 s = _mm256_and_ps(in_range,
+                                 _mm256_mul_ps(vstrength,
+                                               small_exp(_mm256_mul_ps(
+                                                   minus_four, rel_dist))));
+
+        _mm256_storeu_ps(&fx[i], _mm256_sub_ps(_mm256_loadu_ps(&fx[i]),
+                                               _mm256_mul_ps(s, dy)));
+        _mm256_storeu_ps(&fy[i], _mm256_add_ps(_mm256_loadu_ps(&fy[i]),
+                                               _mm256_mul_ps(s, dx)));
+    }
+#endif
+
+    for (; i < count; i++) {
+        float dx = smallest_angle(px[i] - center.x());
+        float dy = smallest_angle(py[i] - center.y());
+
+        float rel_dist = sqrtf(dx * dx + dy * dy) * inv_radius;
+        if (rel_dist > 1.f) {
+            continue;
+        }
+
+        float s = strength * small_exp(-4.f * rel_dist);
+
+        fx[i] -= s * dy;
+        fy[i] += s * dx;
+    }
+}
+
+
+// Pulls every sample towards its neighbors and towards its default latitude
+static void apply_neighbor_forces(const float *px, const float *py,
+                                  float *fx, float *fy, size_t count)
+{
+    float base_y = 17.5f / 180.f * M_PIf;
+
+    // The first and the last sample are each other's neighbors, which needs
+    // the modulo; everything in between can just use i - 1 and i + 1
+    auto scalar = [&](size_t i) {
+        size_t next = (i + count - 1) % count, prev = (i + 1) % count;
+
+        fx[i] += .02f * (smallest_angle(px[next] - px[i]) +
+                         smallest_angle(px[prev] - px[i]));
+        fy[i] += .02f * ((py[next] - py[i]) + (py[prev] - py[i]) +
+                         (base_y - py[i]));
+    };
+
+    scalar(0);
+
+    size_t i = 1;
+
+#ifdef __AVX__
+    __m256 factor = _mm256_set1_ps(.02f), vbase_y = _mm256_set1_ps(base_y);
+
+    for (; i + 8 < count; i += 8) {
+        __m256 x = _mm256_loadu_ps(&px[i]), y = _mm256_loadu_ps(&py[i]);
+        __m256 next_x = _mm256_loadu_ps(&px[i - 1]);
+        __m256 next_y = _mm256_loadu_ps(&py[i - 1]);
+        __m256 prev_x = _mm256_loadu_ps(&px[i + 1]);
+        __m256 prev_y = _mm256_loadu_ps(&py[i + 1]);
+
+        __m256 sx = _mm256_add_ps(smallest_angle(_mm256_sub_ps(next_x, x)),
+                                  smallest_angle(_mm256_sub_ps(prev_x, x)));
+        __m256 sy = _mm256_add_ps(_mm256_add_ps(_mm256_sub_ps(next_y, y),
+                                                _mm256_sub_ps(prev_y, y)),
+                                  _mm256_sub_ps(vbase_y, y));
+
+        _mm256_storeu_ps(&fx[i], _mm256_add_ps(_mm256_loadu_ps(&fx[i]),
+                                               _mm256_mul_ps(factor, sx)));
+        _mm256_storeu_ps(&fy[i], _mm256_add_ps(_mm256_loadu_ps(&fy[i]),
+                                               _mm256_mul_ps(factor, sy)));
+    }
+#endif
+
+    for (; i < count; i++) {
+        scalar(i);
+    }
+}
+
+
+// Adds the glow of a hotspot to the samples at (@px, @py)
+static void apply_hotspot(const float *px, const float *py, float *strength,
+                          size_t count, const Aurora::Hotspot &hs)
+{
+    size_t i = 0;
+    float inv_radius = 1.f / hs.radius;
+    float factor = hs.strength * 5.f;
+
+#ifdef __AVX__
+    __m256 cx = _mm256_set1_ps(hs.center.x());
+    __m256 cy = _mm256_set1_ps(hs.center.y());
+    __m256 vinv_radius = _mm256_set1_ps(inv_radius);
+    __m256 vfactor = _mm256_set1_ps(factor);
+    __m256 one = _mm256_set1_ps(1.f);
+
+    for (; i + 8 <= count; i += 8) {
+        __m256 dx = smallest_angle(_mm256_sub_ps(_mm256_loadu_ps(&px[i]), cx));
+        __m256 dy = smallest_angle(_mm256_sub_ps(_mm256_loadu_ps(&py[i]), cy));
+
+        __m256 rel_dist = _mm256_mul_ps(_mm256_sqrt_ps(
+                              _mm256_add_ps(_mm256_mul_ps(dx, dx),
+                                            _mm256_mul_ps(dy, dy))),
+                              vinv_radius);
+        __m256 in_range = _mm256_cmp_ps(rel_dist, one, _CMP_LE_OQ);
+
+        __m256 falloff = _mm256_sub_ps(one, rel_dist);
+        __m256 s = _mm256_and_ps(in_range,
+                                 _mm256_mul_ps(vfactor,
+                                               _mm256_mul_ps(falloff,
+                                                             falloff)));
+
+        _mm256_storeu_ps(&strength[i],
+                         _mm256_add_ps(_mm256_loadu_ps(&strength[i]), s));
+    }
+#endif
+
+    for (; i < count; i++) {
+        float dx = smallest_angle(px[i] - hs.center.x());
+        float dy = smallest_angle(py[i] - hs.center.y());
+
+        float rel_dist = sqrtf(dx * dx + dy * dy) * inv_radius;
+        if (rel_dist > 1.f) {
+            continue;
+        }
+
+        strength[i] += factor * (1.f - rel_dist) * (1.f - rel_dist);
+    }
+}
+
+
 void Aurora::step(const Aurora &input, const HotspotList &hotspots, const WorldState &out_state)
 {
-    memset(forces.data(), 0, forces.size() * sizeof(fvec2));
+    size_t count = input.pos_x.size();
+
+    std::fill(force_x.begin(), force_x.end(), 0.f);
+    std::fill(force_y.begin(), force_y.end(), 0.f);
+
+    // The samples are integrated explicitly, which becomes unstable for long
+    // steps (i.e. under high time acceleration), so just slow the aurora down
+    // then
+    float interval = out_state.interval > 10.f ? 10.f : out_state.interval;
 
     std::default_random_engine rng(out_state.timestamp.time_since_epoch().count() + (uintptr_t)this);
     std::uniform_real_distribution<float> rng_dist(0.f, 1.f);
 
     circulars = input.circulars;
 
-    if (rng_dist(rng) >= 1.f - out_state.interval / 10.f) {
+    if (rng_dist(rng) >= 1.f - interval / 10.f) {
         CircularForce cf = {
             fvec2(rng_dist(rng) * 2.f * M_PIf,
                   (10.f + rng_dist(rng) * 15.f) / 180.f * M_PIf),
@@ -59,7 +291,7 @@ void Aurora::step(const Aurora &input, const HotspotList &hotspots, const WorldS
     }
 
     for (auto it = circulars.begin(); it != circulars.end();) {
-        it->age += out_state.interval;
+        it->age += interval;
 
         if (it->age > it->duration) {
             it = circulars.erase(it);
@@ -68,80 +300,44 @@ void Aurora::step(const Aurora &input, const HotspotList &hotspots, const WorldS
         }
     }
 
-    for (const CircularForce &cf: input.circulars) {
-        float real_strength = cf.strength * powf(-4.f * (cf.age / cf.duration - .5f) + 1.f, 2.f);
-
-        for (size_t i = 0; i < input.spls.size(); i++) {
-            fvec2 direction = fvec2(input.spls[i].position) - cf.center;
-
-            direction.x() = smallest_angle(direction.x());
-            direction.y() = smallest_angle(direction.y());
-
-            // FIXME: Use meters as radius unit
-            float rel_dist = direction.length() / cf.radius;
-
-            if (rel_dist > 1.f) {
-                continue;
-            }
+    const float *in_x = input.pos_x.data(), *in_y = input.pos_y.data();
 
-            float this_strength = .01f * real_strength * rel_dist * expf(-4.f * rel_dist);
+    for (const CircularForce &cf: input.circulars) {
+        float ramp = -4.f * (cf.age / cf.duration - .5f) + 1.f;
+        float real_strength = cf.strength * ramp * ramp;
 
-            forces[i] += this_strength * fvec2(-direction.y(),
-                                               direction.x()).normalized();
-        }
+        // FIXME: Use meters as radius unit
+        apply_circular_force(in_x, in_y, force_x.data(), force_y.data(), count,
+                             cf.center, cf.radius,
+                             .01f * real_strength / cf.radius);
     }
 
-    for (size_t i = 0; i < input.spls.size(); i++) {
-        const vec2 &this_sample = input.spls[i].position;
-        const vec2 &next_sample = input.spls[(i + input.spls.size() - 1) %
-                                             input.spls.size()].position;
-        const vec2 &prev_sample = input.spls[(i                     + 1) %
-                                              input.spls.size()].position;
-
-        forces[i] += .02f * fvec2(smallest_angle(next_sample.x() -
-                                                 this_sample.x()),
-                                  next_sample.y() - this_sample.y());
+    apply_neighbor_forces(in_x, in_y, force_x.data(), force_y.data(), count);
 
-        forces[i] += .02f * fvec2(smallest_angle(prev_sample.x() -
-                                                 this_sample.x()),
-                                  prev_sample.y() - this_sample.y());
+    for (size_t i = 0; i < count; i++) {
+        pos_x[i] = in_x[i] + interval * force_x[i];
+        pos_y[i] = in_y[i] + interval * force_y[i];
+    }
 
-        forces[i] += .02f * fvec2(0.f,
-                                  17.5f / 180.f * M_PIf - this_sample.y());
+    std::fill(strengths.begin(), strengths.end(), 0.f);
+    for (size_t i = 0; i < hotspots.hotspots.size(); i++) {
+        apply_hotspot(pos_x.data(), pos_y.data(), strengths.data(), count,
+                      hotspots.hotspots[i]);
     }
 
     float texcoord = 0.f;
 
-    for (size_t i = 0; i < input.spls.size(); i++) {
-        fvec2 newspl = fvec2(input.spls[i].position) +
-                       out_state.interval * forces[i];
-
+    for (size_t i = 0; i < count; i++) {
         if (i > 0) {
-            texcoord += (fvec2(input.spls[i - 1].position) -
-                         fvec2(input.spls[i].position)).length() * 2.f;
+            float dx = in_x[i - 1] - in_x[i], dy = in_y[i - 1] - in_y[i];
+
+            texcoord += sqrtf(dx * dx + dy * dy) * 2.f;
             texcoord = fmodf(texcoord, 1.f);
         }
-        spls[i].position = (vec2)newspl;
-        spls[i].texcoord = texcoord;
-        spls[i].strength = 0.f;
-    }
-
-    for (size_t i = 0; i < hotspots.hotspots.size(); i++) {
-        const Hotspot &hs = hotspots.hotspots[i];
-
-        for (Sample &s: spls) {
-            fvec2 direction = fvec2(s.position) - hs.center;
 
-            direction.x() = smallest_angle(direction.x());
-            direction.y() = smallest_angle(direction.y());
-
-            float rel_dist = direction.length() / hs.radius;
-            if (rel_dist > 1.f) {
-                continue;
-            }
-
-            s.strength += hs.strength * powf(1.f - rel_dist, 2.f) * 5.f;
-        }
+        spls[i].position = vec2(pos_x[i], pos_y[i]);
+        spls[i].texcoord = texcoord;
+        spls[i].strength = strengths[i];
     }
 }
 
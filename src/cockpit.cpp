@@ -8,6 +8,7 @@
 #include "localize.hpp"
 #include "options.hpp"
 #include "radar.hpp"
+#include "streaming_buffer.hpp"
 #include "text.hpp"
 #include "weapons.hpp"
 
@@ -21,7 +22,7 @@ using namespace dake;
 using namespace dake::math;
 
 
-static gl::vertex_array *line_va;
+static StreamingBuffer *line_va;
 static gl::program *line_prg, *scratch_prg, *sprite_prg;
 static gl::texture *scratch_tex, *normals_tex;
 
@@ -44,11 +45,9 @@ static void resize(unsigned w, unsigned h);
 
 void init_cockpit(void)
 {
-    line_va = new gl::vertex_array;
+    line_va = new StreamingBuffer(sizeof(vec2), MAX_LINES * 2);
 
-    line_va->attrib(0)->format(2);
-    line_va->attrib(0)->data(nullptr, MAX_LINES * 2 * sizeof(vec2),
-                             GL_DYNAMIC_DRAW, false);
+    line_va->attrib(0, 2, GL_FLOAT, 0);
 
 
     line_prg = new gl::program {gl::shader::vert("shaders/line_vert.glsl"),
@@ -142,10 +141,11 @@ static void resize(unsigned w, unsigned h)
 
 static vec2 *line_mapping;
 static int line_vertex_count;
+static size_t line_first;
 
 static void start_lines(void)
 {
-    line_mapping = static_cast<vec2 *>(line_va->attrib(0)->map());
+    line_mapping = static_cast<vec2 *>(line_va->map(MAX_LINES * 2));
     line_vertex_count = 0;
 }
 
@@ -163,18 +163,15 @@ static void push_line(const fvec2 &start, const fvec2 &end)
 
 static void finish_lines(void)
 {
-    line_va->attrib(0)->unmap();
+    line_first = line_va->unmap(line_vertex_count);
     line_mapping = nullptr;
-
-    line_va->attrib(0)->load();
 }
 
 
 static void draw_lines(void)
 {
     line_prg->use();
-    line_va->set_elements(line_vertex_count);
-    line_va->draw(GL_LINES);
+    line_va->draw(GL_LINES, line_first, line_vertex_count);
 }
 
 
@@ -277,10 +274,10 @@ static fvec2 project_clamp_to_border(const GraphicsStatus &status,
 
 
 static void draw_scratches(const GraphicsStatus &status,
-                           const WorldState &world, gl::framebuffer *main_fb)
+                           const WorldState &world,
+                           const InterpolatedState &view,
+                           gl::framebuffer *main_fb)
 {
-    const ShipState &ship = world.ships[world.player_ship];
-
     (*main_fb)[0].bind();
     scratch_tex->bind();
     normals_tex->bind();
@@ -313,11 +310,11 @@ static void draw_scratches(const GraphicsStatus &status,
     if (!global_options.uniform_scratch_map) {
         scratch_prg->uniform<fvec2>("sun_position")  = projected_sun;
     }
-    scratch_prg->uniform<fvec3>("cam_fwd") = ship.forward;
-    scratch_prg->uniform<fvec3>("cam_right") = ship.right;
-    scratch_prg->uniform<fvec3>("cam_up") = ship.up;
-    scratch_prg->uniform<fmat3>("normal_mat") = fmat3(ship.right, ship.up,
-                                                      ship.forward);
+    scratch_prg->uniform<fvec3>("cam_fwd") = view.forward;
+    scratch_prg->uniform<fvec3>("cam_right") = view.right;
+    scratch_prg->uniform<fvec3>("cam_up") = view.up;
+    scratch_prg->uniform<fmat3>("normal_mat") = fmat3(view.right, view.up,
+                                                      view.forward);
     scratch_prg->uniform<float>("aspect") = status.aspect / (16.f / 9.f);
     scratch_prg->uniform<float>("tan_xhfov") = tanf(status.yfov / 2.f)
                                                * status.aspect;
@@ -332,23 +329,21 @@ static void draw_scratches(const GraphicsStatus &status,
 }
 
 
-static void draw_cockpit_controls(const WorldState &world,
+static void draw_cockpit_controls(const InterpolatedState &view,
                                   float sxs, float sys)
 {
-    const ShipState &ship = world.ships[world.player_ship];
-
     draw_text(fvec2(-1.f + .5f * sxs, 1.f - 1.5f * sys), fvec2(sxs, 2 * sys),
               localize(LS_ORBITAL_VELOCITY));
     draw_text(fvec2(-1.f + .5f * sxs, 1.f - 3.5f * sys), fvec2(sxs, 2 * sys),
-              localize(ship.velocity.length(), 2, LS_UNIT_M_S));
+              localize(view.velocity.length(), 2, LS_UNIT_M_S));
 
     draw_text(fvec2(-1.f + .5f * sxs, 1.f - 5.5f * sys), fvec2(sxs, 2 * sys),
               localize(LS_HEIGHT_OVER_GROUND));
     draw_text(fvec2(-1.f + .5f * sxs, 1.f - 7.5f * sys), fvec2(sxs, 2 * sys),
-              localize(ship.position.length() - 6371e3,
+              localize(view.position.length() - 6371e3,
                        2, LS_UNIT_M));
 
-    float time_factor = world.interval / world.real_interval;
+    float time_factor = view.interval / view.real_interval;
     if (time_factor > 1.f) {
         draw_text(fvec2(-1.f + .5f * sxs, 1.f -  9.5f * sys), fvec2(sxs, 2 * sys),
                   localize(LS_SPEED_UP));
@@ -360,13 +355,14 @@ static void draw_cockpit_controls(const WorldState &world,
 
 static void draw_target_cross(const GraphicsStatus &status,
                               const WorldState &world,
+                              const InterpolatedState &view,
                               float cockpit_brightness, float blink_time,
                               float sxs, float sys,
                               const fvec2 &hbx, const fvec2 &hby)
 {
-    const ShipState &ship = world.ships[world.player_ship];
+    const ShipEquipment &eq = world.ship_equipment[world.player_ship];
 
-    fvec2 fwd_proj = project(status, ship.forward);
+    fvec2 fwd_proj = project(status, view.forward);
     push_line(fwd_proj + fvec2(-sxs, 0.f), fwd_proj + fvec2(sxs, 0.f));
     push_line(fwd_proj + fvec2(0.f, -sys), fwd_proj + fvec2(0.f, sys));
 
@@ -374,8 +370,8 @@ static void draw_target_cross(const GraphicsStatus &status,
     fvec2 sprite_size = 2.f * fvec2(sxs, sys);
 
     bool weapon_fwd_visible;
-    fmat3 local_mat(ship.right, ship.up, -ship.forward);
-    fvec3 weapon_fwd = local_mat * ship.weapon_forwards[0];
+    fmat3 local_mat(view.right, view.up, -view.forward);
+    fvec3 weapon_fwd = local_mat * eq.weapon_forwards[0];
 
     fvec2 aim_proj = project_clamp_to_border(status, weapon_fwd, hbx, hby,
                                              sprite_size, &weapon_fwd_visible);
@@ -390,13 +386,12 @@ static void draw_target_cross(const GraphicsStatus &status,
 
 
 static void draw_velocity_indicators(const GraphicsStatus &status,
-                                     const WorldState &world,
+                                     const InterpolatedState &view,
                                      float cockpit_brightness,
                                      float sxs, float sys,
                                      const fvec2 &hbx, const fvec2 &hby)
 {
-    const ShipState &ship = world.ships[world.player_ship];
-    const fvec3 &velocity = ship.velocity;
+    fvec3 velocity = view.velocity;
 
     if (!velocity.length()) {
         return;
@@ -428,12 +423,13 @@ static void draw_velocity_indicators(const GraphicsStatus &status,
 
 static void draw_orbit_grid(const GraphicsStatus &status,
                             const WorldState &world,
+                            const InterpolatedState &view,
                             float cockpit_brightness,
                             float aspect, float sxs, float sys,
                             const fvec2 &hbx, const fvec2 &hby)
 {
     const ShipState &ship = world.ships[world.player_ship];
-    const fvec3 &velocity = ship.velocity;
+    fvec3 velocity = view.velocity;
 
     if (!velocity.length()) {
         return;
@@ -492,13 +488,11 @@ static void draw_orbit_grid(const GraphicsStatus &status,
 
 
 static void draw_artificial_horizon(const GraphicsStatus &status,
-                                    const WorldState &world,
+                                    const InterpolatedState &view,
                                     float aspect, float sxs, float sys,
                                     const fvec2 &hbx, const fvec2 &hby)
 {
-    const ShipState &ship = world.ships[world.player_ship];
-
-    fvec3 earth_upward = fvec3(ship.position).normalized();
+    fvec3 earth_upward = fvec3(view.position).normalized();
     fvec3 horizon = (status.camera_forward -
                      dotp(status.camera_forward, earth_upward) * earth_upward)
                     .approx_normalized();
@@ -538,6 +532,7 @@ static void draw_artificial_horizon(const GraphicsStatus &status,
 
 static void draw_radar_contacts(const GraphicsStatus &status,
                                 const WorldState &world,
+                                const InterpolatedState &view,
                                 float cockpit_brightness, float blink_time,
                                 float sxs, float sys,
                                 const fvec2 &hbx, const fvec2 &hby)
@@ -545,14 +540,18 @@ static void draw_radar_contacts(const GraphicsStatus &status,
     fvec2 sprite_size = 2.f * fvec2(sxs, sys);
 
     const ShipState &player = world.ships[world.player_ship];
-    const Radar &r = player.radar;
+    const Radar &r = world.radars[world.player_ship];
 
     for (const RadarTarget &t: r.targets) {
+        // Contacts are relative to the player, so they can only be moved
+        // along their relative velocity
+        fvec3 rel_pos = t.relative_position - view.back * t.relative_velocity;
+
         bool visible;
-        fvec2 proj = project_clamp_to_border(status, t.relative_position,
-                                             hbx, hby, sprite_size, &visible);
+        fvec2 proj = project_clamp_to_border(status, rel_pos, hbx, hby,
+                                             sprite_size, &visible);
 
-        float distance = t.relative_position.length();
+        float distance = rel_pos.length();
 
         // Display the marker if one of the following is true:
         // (1) It is in view
@@ -570,7 +569,7 @@ static void draw_radar_contacts(const GraphicsStatus &status,
         }
 
         if (visible) {
-            float rel_speed = dotp(t.relative_position.approx_normalized(),
+            float rel_speed = dotp(rel_pos.approx_normalized(),
                                    t.relative_velocity);
 
             draw_text(proj + fvec2(0.f, 3.f * sys), fvec2(sxs * .5f, sys),
@@ -624,14 +623,14 @@ static void draw_radar_contacts(const GraphicsStatus &status,
             enum WeaponType wt = player.ship->weapons[0].type;
             const WeaponClass *wc = weapon_classes[wt];
 
-            float p_sqr = dotp(t.relative_position, t.relative_position);
+            float p_sqr = dotp(rel_pos, rel_pos);
             float s_sqr = wc->projectile_velocity * wc->projectile_velocity;
             float v_sqr = dotp(t.relative_velocity, t.relative_velocity);
-            float np2 = dotp(t.relative_position, t.relative_velocity) / s_sqr;
+            float np2 = dotp(rel_pos, t.relative_velocity) / s_sqr;
             float nq = (p_sqr + v_sqr) / s_sqr;
 
             float t2 = np2 + sqrtf(np2 * np2 + nq);
-            fvec3 aim2 = t.relative_position + t2 * t.relative_velocity;
+            fvec3 aim2 = rel_pos + t2 * t.relative_velocity;
 
             aim_proj = project_clamp_to_border(status, aim2, hbx, hby,
                                                sprite_size, &aim_visible);
@@ -643,12 +642,13 @@ static void draw_radar_contacts(const GraphicsStatus &status,
 }
 
 
-void draw_cockpit(const GraphicsStatus &status, const WorldState &world)
+void draw_cockpit(const GraphicsStatus &status, const WorldState &world,
+                  const InterpolatedState &view)
 {
     // FIXME
     static float cockpit_brightness = 1.f;
 
-    float brightness_adaption_interval = world.interval;
+    float brightness_adaption_interval = view.interval;
     // With time speed-up, we need to limit this so we don't get flickering
     if (brightness_adaption_interval > 1.f) {
         brightness_adaption_interval = 1.f;
@@ -666,7 +666,7 @@ void draw_cockpit(const GraphicsStatus &status, const WorldState &world)
     cockpit_fb->bind();
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    draw_scratches(status, world, main_fb);
+    draw_scratches(status, world, view, main_fb);
 
 #ifdef COCKPIT_SUPERSAMPLING
     cockpit_ms_fb->bind();
@@ -679,12 +679,12 @@ void draw_cockpit(const GraphicsStatus &status, const WorldState &world)
     static float blink_time = 0.f;
     float sxs = .01f, sys = .01f * aspect;
 
-    blink_time = fmodf(blink_time + world.interval, 1.f);
+    blink_time = fmodf(blink_time + view.interval, 1.f);
 
     set_text_color(fvec4(0.f, cockpit_brightness, 0.f, 1.f));
     line_prg->uniform<fvec4>("color") = fvec4(0.f, cockpit_brightness, 0.f, 1.f);
 
-    draw_cockpit_controls(world, sxs, sys);
+    draw_cockpit_controls(view, sxs, sys);
 
 
     unsigned hud_height = height * 3 / 4;
@@ -702,21 +702,21 @@ void draw_cockpit(const GraphicsStatus &status, const WorldState &world)
 
     start_lines();
 
-    draw_orbit_grid(status, world, cockpit_brightness, aspect, sxs, sys,
-                    hbx, hby);
-    draw_artificial_horizon(status, world, aspect, sxs, sys, hbx, hby);
+    draw_orbit_grid(status, world, view, cockpit_brightness, aspect,
+                    sxs, sys, hbx, hby);
+    draw_artificial_horizon(status, view, aspect, sxs, sys, hbx, hby);
 
-    draw_target_cross(status, world, cockpit_brightness, blink_time, sxs, sys,
-                      hbx, hby);
+    draw_target_cross(status, world, view, cockpit_brightness, blink_time,
+                      sxs, sys, hbx, hby);
 
     finish_lines();
 
 
-    draw_velocity_indicators(status, world, cockpit_brightness, sxs, sys,
+    draw_velocity_indicators(status, view, cockpit_brightness, sxs, sys,
                              hbx, hby);
 
-    draw_radar_contacts(status, world, cockpit_brightness, blink_time, sxs, sys,
-                        hbx, hby);
+    draw_radar_contacts(status, world, view, cockpit_brightness, blink_time,
+                        sxs, sys, hbx, hby);
 
 
     draw_lines();
@@ -4,7 +4,6 @@
 #include <cstdio>
 #include <cstring>
 #include <string>
-#include <thread>
 #include <tuple>
 #include <vector>
 
@@ -13,7 +12,9 @@
 #include "environment.hpp"
 #include "gltf.hpp"
 #include "graphics.hpp"
+#include "jobs.hpp"
 #include "options.hpp"
+#include "streaming_buffer.hpp"
 
 
 using namespace dake;
@@ -31,7 +32,9 @@ static gl::cubemap *skybox_tex;
 static gl::program *earth_prg, *cloud_prg, *atmob_prg, *atmof_prg, *atmoi_prg, *sun_prg, *moon_prg, *aurora_prg, *skybox_prg;
 static gl::framebuffer *sub_atmo_fbo;
 static gl::vertex_attrib *earth_tex_va;
-static std::vector<gl::vertex_array *> aurora_vas;
+static StreamingBuffer *aurora_data;
+// Per aurora, index of its first sample in aurora_data
+static std::vector<size_t> aurora_firsts;
 
 // type \in \{ day, night \}
 static int max_tex_per_type = 20;
@@ -522,9 +525,6 @@ static void perform_lod_update(vec<2, int32_t> *indices)
 }
 
 
-static bool lod_loading_complete = false, lod_unloading_complete = false;
-
-
 static void lod_load_images(void)
 {
     for (int lod = min_lod; lod <= max_lod; lod++) {
@@ -541,8 +541,6 @@ static void lod_load_images(void)
             }
         }
     }
-
-    lod_loading_complete = true;
 }
 
 
@@ -596,8 +594,6 @@ static void lod_unload_images(void)
             }
         }
     }
-
-    lod_unloading_complete = true;
 }
 
 
@@ -619,8 +615,6 @@ static void lod_unload_textures(void)
             }
         }
     }
-
-    lod_unloading_complete = true;
 }
 
 
@@ -746,19 +740,16 @@ static int covered_map_fcr(int *map, int lod)
 static void update_lods(const GraphicsStatus &gstat, const fmat4 &cur_earth_mv,
                         bool update)
 {
-    static std::thread *loading_thread = nullptr, *unloading_thread = nullptr;
+    static JobGroup lod_jobs;
+    static bool loading = false, unloading = false;
     static vec<2, int32_t> *indices;
 
-    if ((loading_thread && !lod_loading_complete) || (unloading_thread && !lod_unloading_complete)) {
+    if (!lod_jobs.done()) {
         return;
     }
 
-    if (loading_thread) {
-        loading_thread->join();
-        delete loading_thread;
-        loading_thread = nullptr;
-
-        lod_loading_complete = false;
+    if (loading) {
+        loading = false;
 
         lod_load_textures();
         lod_set_uniforms();
@@ -767,15 +758,12 @@ static void update_lods(const GraphicsStatus &gstat, const fmat4 &cur_earth_mv,
         earth_tex_va->unmap();
         delete[] indices;
 
-        unloading_thread = new std::thread(lod_unload_images);
+        unloading = true;
+        lod_jobs.run_background(lod_unload_images);
 
         return;
-    } else if (unloading_thread) {
-        unloading_thread->join();
-        delete unloading_thread;
-        unloading_thread = nullptr;
-
-        lod_unloading_complete = false;
+    } else if (unloading) {
+        unloading = false;
 
         lod_unload_textures();
     }
@@ -906,64 +894,58 @@ static void update_lods(const GraphicsStatus &gstat, const fmat4 &cur_earth_mv,
 
         perform_lod_update(indices);
 
-        loading_thread = new std::thread(lod_load_images);
+        loading = true;
+        lod_jobs.run_background(lod_load_images);
     }
 }
 
 
-void draw_environment(const GraphicsStatus &status, const WorldState &world)
+void draw_environment(const GraphicsStatus &status, const WorldState &world,
+                      const InterpolatedState &view)
 {
-    const ShipState &ship = world.ships[world.player_ship];
 
     if (global_options.aurora) {
         // Load dynamic data first, so it can be copied over the course of the function
-        if (aurora_vas.empty()) {
-            for (size_t i = 0; i < world.auroras.size(); i++) {
-                gl::vertex_array *aurora_va = new gl::vertex_array;
-                aurora_va->set_elements(world.auroras[i].samples().size());
-
-                aurora_va->attrib(0)->format(2);
-                aurora_va->attrib(0)->data(nullptr,
-                                           world.auroras[i].samples().size()
-                                           * sizeof(Aurora::Sample),
-                                           GL_DYNAMIC_DRAW, false);
-
-                aurora_va->attrib(1)->format(1);
-                aurora_va->attrib(1)->reuse_buffer(aurora_va->attrib(0));
+        if (!aurora_data) {
+            size_t sample_count = 0;
+            for (const Aurora &aurora: world.auroras) {
+                sample_count += aurora.samples().size();
+            }
 
-                aurora_va->attrib(2)->format(1);
-                aurora_va->attrib(2)->reuse_buffer(aurora_va->attrib(0));
+            aurora_data = new StreamingBuffer(sizeof(Aurora::Sample),
+                                              sample_count);
 
-                aurora_vas.push_back(aurora_va);
-            }
+            aurora_data->attrib(0, 2, GL_FLOAT,
+                                offsetof(Aurora::Sample, position));
+            aurora_data->attrib(1, 1, GL_FLOAT,
+                                offsetof(Aurora::Sample, texcoord));
+            aurora_data->attrib(2, 1, GL_FLOAT,
+                                offsetof(Aurora::Sample, strength));
         }
 
-        for (size_t i = 0; i < aurora_vas.size(); i++) {
-            memcpy(aurora_vas[i]->attrib(0)->map(),
-                   world.auroras[i].samples().data(),
-                   world.auroras[i].samples().size() * sizeof(Aurora::Sample));
+        aurora_firsts.resize(world.auroras.size());
+
+        for (size_t i = 0; i < world.auroras.size(); i++) {
+            const AlignedVector<Aurora::Sample> &samples =
+                world.auroras[i].samples();
 
-            aurora_vas[i]->attrib(0)->unmap();
+            memcpy(aurora_data->map(samples.size()), samples.data(),
+                   samples.size() * sizeof(Aurora::Sample));
 
-            aurora_vas[i]->attrib(0)->load(sizeof(Aurora::Sample),
-                                           offsetof(Aurora::Sample, position));
-            aurora_vas[i]->attrib(1)->load(sizeof(Aurora::Sample),
-                                           offsetof(Aurora::Sample, texcoord));
-            aurora_vas[i]->attrib(2)->load(sizeof(Aurora::Sample),
-                                           offsetof(Aurora::Sample, strength));
+            aurora_firsts[i] = aurora_data->unmap(samples.size());
         }
     }
 
 
-    fmat4 cur_cloud_mv  = world.earth_mv.scaled(fvec3(6381e3f / 6371e3f));
-    fmat4 cur_atmo_mv   = world.earth_mv.scaled(fvec3(6441e3f / 6371e3f));
-    fmat4 cur_aurora_mv = world.earth_mv.scaled(fvec3(6421e3f / 6371e3f));
+    fmat4 cur_cloud_mv  = view.earth_mv.scaled(fvec3(6381e3f / 6371e3f));
+    fmat4 cur_atmo_mv   = view.earth_mv.scaled(fvec3(6441e3f / 6371e3f));
+    fmat4 cur_aurora_mv = view.earth_mv.scaled(fvec3(6421e3f / 6371e3f));
 
 
     static float lod_update_timer;
 
-    lod_update_timer += world.interval;
-    update_lods(status, world.earth_mv, lod_update_timer >= .2f);
+    lod_update_timer += view.interval;
+    update_lods(status, view.earth_mv, lod_update_timer >= .2f);
     lod_update_timer = fmodf(lod_update_timer, .2f);
 
 
@@ -1060,9 +1042,9 @@ void draw_environment(const GraphicsStatus &status, const WorldState &world)
     glCullFace(GL_BACK);
 
     earth_prg->use();
-    earth_prg->uniform<fmat4>("mat_mv") = world.earth_mv;
+    earth_prg->uniform<fmat4>("mat_mv") = view.earth_mv;
     earth_prg->uniform<fmat4>("mat_proj") = sa_proj * status.world_to_camera;
-    earth_prg->uniform<fmat3>("mat_nrm") = fmat3(world.earth_mv)
+    earth_prg->uniform<fmat3>("mat_nrm") = fmat3(view.earth_mv)
                                            .transposed_inverse();
     earth_prg->uniform<fvec3>("cam_pos") = status.camera_position;
     earth_prg->uniform<fvec3>("light_dir") = world.sun_light_dir;
@@ -1136,8 +1118,8 @@ void draw_environment(const GraphicsStatus &status, const WorldState &world)
         draw_earth_prg->uniform<fmat3>("mat_nrm") = fmat3(cur_atmo_mv)
                                                     .transposed_inverse();
     } else {
-        draw_earth_prg->uniform<fvec3>("cam_right") = ship.right;
-        draw_earth_prg->uniform<fvec3>("cam_up") = ship.up;
+        draw_earth_prg->uniform<fvec3>("cam_right") = view.right;
+        draw_earth_prg->uniform<fvec3>("cam_up") = view.up;
         draw_earth_prg->uniform<float>("height") = height / 70e3f;
         draw_earth_prg->uniform<float>("tan_xhfov") = tanf(status.yfov / 2.f)
                                                       * status.aspect;
@@ -1186,8 +1168,9 @@ void draw_environment(const GraphicsStatus &status, const WorldState &world)
 
         glDisable(GL_CULL_FACE);
         glDisable(GL_DEPTH_TEST);
-        for (gl::vertex_array *va: aurora_vas) {
-            va->draw(GL_LINE_LOOP);
+        for (size_t i = 0; i < world.auroras.size(); i++) {
+            aurora_data->draw(GL_LINE_LOOP, aurora_firsts[i],
+                              world.auroras[i].samples().size());
         }
         glEnable(GL_DEPTH_TEST);
         glEnable(GL_CULL_FACE);
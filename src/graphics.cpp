@@ -1,3 +1,4 @@
+#include <chrono>
 #include <cmath>
 #include <dake/dake.hpp>
 
@@ -261,29 +262,42 @@ static void do_bloom(void)
 }
 
 
-void do_graphics(const WorldState &input)
+void do_graphics(const WorldState &previous, const WorldState &current,
+                 float alpha)
 {
+    static InterpolatedState view;
+    static auto last_frame = std::chrono::steady_clock::now();
+
+    auto now = std::chrono::steady_clock::now();
+    float frame_interval =
+        std::chrono::duration_cast<std::chrono::duration<float>>
+            (now - last_frame).count();
+    last_frame = now;
+
+    interpolate_world_states(view, previous, current, alpha, frame_interval);
+
+
     if (change_width && change_height) {
         update_resolution();
     }
 
 
-    const ShipState &ps = input.ships[input.player_ship];
+    const ShipState &ps = current.ships[current.player_ship];
 
-    status.camera_position = ps.position
-                           + fmat3(ps.right, ps.up, -ps.forward) *
+    status.camera_position = view.position
+                           + fmat3(view.right, view.up, -view.forward) *
                              ps.ship->cockpit_position;
 
-    status.camera_forward  = ps.forward;
+    status.camera_forward  = view.forward;
 
     calculate_camera(status.world_to_camera,
                      (fvec3)status.camera_position,
-                     status.camera_forward, ps.up);
+                     status.camera_forward, view.up);
     calculate_camera(status.relative_to_camera, fvec3::zero(),
-                     status.camera_forward, ps.up);
+                     status.camera_forward, view.up);
 
 
-    status.time_speed_up = input.time_speed_up;
+    status.time_speed_up = current.time_speed_up;
 
 
     glEnable(GL_BLEND);
@@ -295,13 +309,13 @@ void do_graphics(const WorldState &input)
     main_fb->bind();
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    draw_environment(status, input);
+    draw_environment(status, current, view);
 
-    draw_particles(status, input.particles);
+    draw_particles(status, view);
 
     glDisable(GL_DEPTH_TEST);
 
-    draw_cockpit(status, input);
+    draw_cockpit(status, current, view);
 
 
     glDisable(GL_BLEND);
@@ -367,7 +381,7 @@ void do_graphics(const WorldState &input)
     ui_swap_buffers();
 
 
-    status.luminance += input.real_interval * (highest_avg - status.luminance);
+    status.luminance += view.real_interval * (highest_avg - status.luminance);
 
     if (status.luminance > 2.f) {
         status.luminance = 2.f;
@@ -0,0 +1,14 @@
+#include <string>
+
+#include "ui.hpp"
+
+
+float Input::get_mapping(const std::string &n) const
+{
+    auto it = mapping_states.find(n);
+    if (it == mapping_states.end()) {
+        return 0.f;
+    }
+
+    return it->second;
+}
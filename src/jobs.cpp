@@ -0,0 +1,267 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "jobs.hpp"
+
+
+struct Job {
+    std::function<void(void)> fn;
+    JobGroup *group;
+
+    void execute(void)
+    {
+        fn();
+        // The group may be gone right after this
+        group->pending--;
+    }
+};
+
+
+struct JobQueue {
+    std::mutex lock;
+    std::deque<Job> jobs;
+};
+
+
+// Every worker pushes to and pops from the back of its own queue and steals
+// from the front of the others' queues. Never freed, because the workers are
+// never stopped.
+struct JobPool {
+    // queues[0] receives the jobs submitted by non-worker threads,
+    // queues[i] the ones submitted by worker i
+    std::vector<std::unique_ptr<JobQueue>> queues;
+    JobQueue background;
+
+    // Number of jobs in all queues (including the background queue)
+    std::atomic<int> queued_jobs;
+
+    std::mutex sleep_lock;
+    std::condition_variable sleep_cond;
+};
+
+static JobPool *pool;
+
+static thread_local int current_slot = 0;
+
+
+static void submit(JobQueue &queue, Job &&job)
+{
+    {
+        std::lock_guard<std::mutex> guard(queue.lock);
+        queue.jobs.push_back(std::move(job));
+        pool->queued_jobs++;
+    }
+
+    // Taking the lock makes sure that no worker is between checking
+    // queued_jobs and going to sleep
+    {
+        std::lock_guard<std::mutex> guard(pool->sleep_lock);
+    }
+    pool->sleep_cond.notify_one();
+}
+
+
+static bool pop_job(JobQueue &queue, bool back, Job *job)
+{
+    std::lock_guard<std::mutex> guard(queue.lock);
+
+    if (queue.jobs.empty()) {
+        return false;
+    }
+
+    if (back) {
+        *job = std::move(queue.jobs.back());
+        queue.jobs.pop_back();
+    } else {
+        *job = std::move(queue.jobs.front());
+        queue.jobs.pop_front();
+    }
+
+    pool->queued_jobs--;
+    return true;
+}
+
+
+static bool find_job(int slot, bool background, Job *job)
+{
+    size_t queue_count = pool->queues.size();
+
+    if (pop_job(*pool->queues[slot], true, job)) {
+        return true;
+    }
+
+    for (size_t i = 1; i < queue_count; i++) {
+        if (pop_job(*pool->queues[(slot + i) % queue_count], false, job)) {
+            return true;
+        }
+    }
+
+    return background && pop_job(pool->background, false, job);
+}
+
+
+static void worker(int slot)
+{
+    current_slot = slot;
+
+    for (;;) {
+        Job job;
+        if (find_job(slot, true, &job)) {
+            job.execute();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(pool->sleep_lock);
+        pool->sleep_cond.wait(lock, [](void) {
+                return pool->queued_jobs.load() > 0;
+            });
+    }
+}
+
+
+// Only started if there are no workers: Runs background jobs, which must never
+// end up on the thread submitting them (e.g. the render thread)
+static void background_worker(void)
+{
+    for (;;) {
+        Job job;
+        if (pop_job(pool->background, false, &job)) {
+            job.execute();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(pool->sleep_lock);
+        pool->sleep_cond.wait(lock, [](void) {
+                return pool->queued_jobs.load() > 0;
+            });
+    }
+}
+
+
+void init_jobs(int threads)
+{
+    if (threads <= 0) {
+        threads = std::thread::hardware_concurrency();
+        if (threads <= 0) {
+            threads = 1;
+        }
+    }
+
+    pool = new JobPool;
+    pool->queued_jobs.store(0);
+
+    for (int i = 0; i < threads; i++) {
+        pool->queues.emplace_back(new JobQueue);
+    }
+
+    for (int i = 1; i < threads; i++) {
+        std::thread(worker, i).detach();
+    }
+
+    if (threads < 2) {
+        std::thread(background_worker).detach();
+    }
+}
+
+
+int job_slot_count(void)
+{
+    return pool ? pool->queues.size() : 1;
+}
+
+
+int job_slot(void)
+{
+    return current_slot;
+}
+
+
+JobGroup::JobGroup(void)
+{
+    pending.store(0);
+}
+
+
+JobGroup::~JobGroup(void)
+{
+    wait();
+}
+
+
+void JobGroup::run(const std::function<void(void)> &job)
+{
+    if (job_slot_count() < 2) {
+        job();
+        return;
+    }
+
+    pending++;
+    submit(*pool->queues[current_slot], Job{job, this});
+}
+
+
+void JobGroup::run_background(const std::function<void(void)> &job)
+{
+    if (!pool) {
+        job();
+        return;
+    }
+
+    pending++;
+    submit(pool->background, Job{job, this});
+}
+
+
+bool JobGroup::done(void) const
+{
+    return !pending.load();
+}
+
+
+void JobGroup::wait(void)
+{
+    while (pending.load()) {
+        Job job;
+        if (find_job(current_slot, false, &job)) {
+            job.execute();
+        } else {
+            std::this_thread::yield();
+        }
+    }
+}
+
+
+void parallel_for(size_t count, size_t grain,
+                  const std::function<void(size_t begin, size_t end)> &fn)
+{
+    if (!count) {
+        return;
+    }
+
+    // More chunks than threads so that stealing can even out differences,
+    // but not so many that queueing them is more work than running them
+    size_t slots = job_slot_count();
+    grain = std::max(grain, (count + 4 * slots - 1) / (4 * slots));
+    grain = std::max(grain, static_cast<size_t>(1));
+
+    if (slots < 2 || grain >= count) {
+        fn(0, count);
+        return;
+    }
+
+    JobGroup group;
+    for (size_t begin = grain; begin < count; begin += grain) {
+        size_t end = std::min(begin + grain, count);
+        group.run([&fn, begin, end](void) { fn(begin, end); });
+    }
+
+    fn(0, grain);
+    group.wait();
+}
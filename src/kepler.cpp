@@ -0,0 +1,91 @@
+#include <dake/math/fmatrix.hpp>
+
+#include <cmath>
+
+#include "kepler.hpp"
+#include "runge-kutta-4.hpp"
+
+
+using namespace dake::math;
+
+
+bool KeplerOrbit::from_state(const fvec3d &pos, const fvec3d &vel)
+{
+    valid = false;
+
+    double r = pos.length();
+    fvec3d h = pos.cross(vel);
+    double h_len = h.length();
+
+    // Radial trajectories have no orbital plane
+    if (r <= EARTH_RADIUS || h_len < 1e-6 * r) {
+        return false;
+    }
+
+    double energy = .5 * vel.dot(vel) - EARTH_GM / r;
+    if (energy >= 0.) {
+        return false;
+    }
+
+    a = -EARTH_GM / (2. * energy);
+
+    fvec3d e_vec = vel.cross(h) * (1. / EARTH_GM) - pos * (1. / r);
+    e = e_vec.length();
+
+    // The periapsis must be above the surface, because below there is no
+    // gravity (and a ship would crash anyway)
+    if (e >= 1. || a * (1. - e) <= EARTH_RADIUS) {
+        return false;
+    }
+
+    // For (nearly) circular orbits, any direction will do
+    p = e > 1e-9 ? e_vec * (1. / e) : pos * (1. / r);
+    q = (h * (1. / h_len)).cross(p);
+
+    n = sqrt(EARTH_GM / (a * a * a));
+
+    double ecc_anomaly = atan2(pos.dot(q) / (a * sqrt(1. - e * e)),
+                               pos.dot(p) / a + e);
+    mean_anomaly = ecc_anomaly - e * sin(ecc_anomaly);
+
+    position = pos;
+    velocity = vel;
+
+    valid = true;
+    return true;
+}
+
+
+void KeplerOrbit::propagate(double dt)
+{
+    mean_anomaly = fmod(mean_anomaly + n * dt, 2. * M_PI);
+
+    // Solve Kepler's equation M = E - e sin E with Newton's method
+    double ecc_anomaly = e > .8 ? M_PI : mean_anomaly;
+    for (int i = 0; i < 32; i++) {
+        double delta = (ecc_anomaly - e * sin(ecc_anomaly) - mean_anomaly)
+                       / (1. - e * cos(ecc_anomaly));
+        ecc_anomaly -= delta;
+
+        if (fabs(delta) < 1e-12) {
+            break;
+        }
+    }
+
+    double cos_e = cos(ecc_anomaly), sin_e = sin(ecc_anomaly);
+    double b_factor = sqrt(1. - e * e);
+
+    position = p * (a * (cos_e - e)) + q * (a * b_factor * sin_e);
+    velocity = (p * -sin_e + q * (b_factor * cos_e))
+               * (n * a / (1. - e * cos_e));
+}
+
+
+bool KeplerOrbit::matches(const fvec3d &pos, const fvec3d &vel) const
+{
+    return valid &&
+           pos.x() == position.x() && pos.y() == position.y() &&
+           pos.z() == position.z() &&
+           vel.x() == velocity.x() && vel.y() == velocity.y() &&
+           vel.z() == velocity.z();
+}
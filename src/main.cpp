@@ -13,6 +13,7 @@
 #include <dake/cross.hpp>
 
 #include "graphics.hpp"
+#include "jobs.hpp"
 #include "main_loop.hpp"
 #include "menu.hpp"
 #include "options.hpp"
@@ -34,11 +35,12 @@ int main(int argc, char *argv[])
             {"help", no_argument, nullptr, 'h'},
             {"min-lod", required_argument, nullptr, 256},
             {"max-lod", required_argument, nullptr, 257},
-            {"disable-aurora", no_argument, nullptr, 258},
             {"scratch-map-res", required_argument, nullptr, 259},
             {"uniform-scratch-map", no_argument, nullptr, 260},
             {"star-map-res", required_argument, nullptr, 261},
             {"bloom", required_argument, nullptr, 262},
+            {"physics-rate", required_argument, nullptr, 263},
+            COMMON_LONG_OPTIONS,
 
             {nullptr, 0, nullptr, 0}
         };
@@ -56,7 +58,6 @@ int main(int argc, char *argv[])
                 fprintf(stderr, "  -h, --help       Shows this information\n");
                 fprintf(stderr, "  --min-lod=LOD    Sets the minimum LOD (0..8; default: 0)\n");
                 fprintf(stderr, "  --max-lod=LOD    Sets the maximum LOD (3..8; default: 8)\n");
-                fprintf(stderr, "  --disable-aurora Disables aurora borealis and australis\n");
                 fprintf(stderr, "  --scratch-map-res=resolution\n");
                 fprintf(stderr, "                   Sets the vertical resolution of the scratch map\n");
                 fprintf(stderr, "                   (720 or 1080)\n");
@@ -68,6 +69,10 @@ int main(int argc, char *argv[])
                 fprintf(stderr, "  --bloom=<no,lq,hq>\n");
                 fprintf(stderr, "                   Chooses how to draw bloom (no: not at all; lq: with rather\n");
                 fprintf(stderr, "                   low quality; hq (default): best quality available)\n");
+                fprintf(stderr, "  --physics-rate=Hz\n");
+                fprintf(stderr, "                   Runs physics at a fixed rate (in steps per second)\n");
+                fprintf(stderr, "                   instead of once per frame\n");
+                print_common_options_help();
                 return 0;
 
             case 256: {
@@ -96,10 +101,6 @@ int main(int argc, char *argv[])
                 break;
             }
 
-            case 258:
-                global_options.aurora = false;
-                break;
-
             case 259: {
                 char *endp;
                 errno = 0;
@@ -142,6 +143,25 @@ int main(int argc, char *argv[])
                     return 1;
                 }
                 break;
+
+            case 263: {
+                char *endp;
+                errno = 0;
+                unsigned long rate = strtoul(optarg, &endp, 0);
+                if (errno || !rate || (rate > 10000) || *endp) {
+                    fprintf(stderr, "Invalid argument given for --physics-rate (1..10000)\n");
+                    return 1;
+                }
+
+                global_options.physics_step = 1.f / rate;
+                break;
+            }
+
+            default:
+                if (!parse_common_option(option, optarg)) {
+                    return 1;
+                }
+                break;
         }
     }
 
@@ -156,6 +176,7 @@ int main(int argc, char *argv[])
     tzset();
 
 
+    init_jobs(global_options.job_threads);
     init_ui();
 
     std::string scenario = menu_loop();
@@ -1,47 +1,130 @@
+#include <atomic>
 #include <cassert>
-#include <condition_variable>
+#include <chrono>
+#include <cstdint>
 #include <memory>
-#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
 
 #include "graphics.hpp"
 #include "main_loop.hpp"
+#include "options.hpp"
 #include "physics.hpp"
 #include "sound.hpp"
 #include "ui.hpp"
 
 
-static bool quit = false;
+// The graphics thread holds up to two states (the ones it interpolates
+// between), the latest published pair may be two different ones and the
+// physics thread needs one to write to; so with five states, the physics thread
+// will always find a free one.
+#define WORLD_STATE_COUNT 5
 
 
+static std::atomic<bool> quit(false);
+
+
+// The physics thread publishes every new state together with the one before
+// it by atomically replacing SharedInfo::published; the graphics thread takes
+// that pair and marks both states as being read.  Neither thread ever waits
+// for the other (except when running physics with a variable step length, see
+// below).
 struct SharedInfo {
     std::vector<std::shared_ptr<WorldState>> world_states;
     std::shared_ptr<Input> input;
-    volatile int current_graphics_state, current_physics_state;
-    std::condition_variable cgs_change;
-    std::mutex cgs_change_mtx;
+    std::shared_ptr<PhysicsClock> clock;
+
+    // Bits 0..7: latest state; bits 8..15: previous state; bits 16..63:
+    // sequence number
+    std::atomic<uint64_t> published;
+
+    // When each state was published; only written for states not in use by
+    // the graphics thread
+    std::chrono::steady_clock::time_point publish_times[WORLD_STATE_COUNT];
+
+    // Number of times each state is currently in use by the graphics thread
+    std::atomic<int> readers[WORLD_STATE_COUNT];
+
+    // Sequence number of the latest state picked up by the graphics thread
+    std::atomic<uint64_t> consumed_seq;
 };
 
 
+static uint64_t pack_published(int latest, int previous, uint64_t seq)
+{
+    return static_cast<uint64_t>(latest)
+         | (static_cast<uint64_t>(previous) << 8)
+         | (seq << 16);
+}
+
+
 static void physics_worker(SharedInfo &info)
 {
-    std::unique_lock<std::mutex> lock(info.cgs_change_mtx);
+    uint64_t published = info.published.load();
+    int latest   =  published       & 0xff;
+    int previous = (published >> 8) & 0xff;
+    uint64_t seq =  published >> 16;
 
-    assert(info.world_states.size() == 2);
+    bool variable_step = !global_options.physics_step;
+
+    // Intermediate state for when more than one step is run per frame
+    std::unique_ptr<WorldState> scratch_state(new WorldState);
 
     while (!quit) {
-        while (info.current_physics_state != info.current_graphics_state) {
-            info.cgs_change.wait(lock);
+        // Variable steps are as long as the time between two frames, so there
+        // should be exactly one per frame
+        if (variable_step) {
+            while (!quit && info.consumed_seq.load() != seq) {
+                std::this_thread::sleep_for(std::chrono::microseconds(100));
+            }
+        }
+
+        int steps = info.clock->tick();
+        if (!steps) {
+            std::this_thread::sleep_for(std::chrono::duration<float>(
+                                            info.clock->time_to_next_step()));
+            continue;
+        }
+
+        int next_state = -1;
+        while (next_state < 0 && !quit) {
+            for (int i = 0; i < WORLD_STATE_COUNT; i++) {
+                if (i != latest && i != previous && !info.readers[i].load()) {
+                    next_state = i;
+                    break;
+                }
+            }
+
+            if (next_state < 0) {
+                std::this_thread::yield();
+            }
         }
 
-        int next_state = (info.current_physics_state + 1) % 2;
+        if (next_state < 0) {
+            break;
+        }
+
+        // Alternate between the scratch state and the next state so that the
+        // last step ends up in the latter
+        const WorldState *in = info.world_states[latest].get();
+        for (int i = 0; i < steps; i++) {
+            WorldState *out = (steps - i) % 2
+                              ? info.world_states[next_state].get()
+                              : scratch_state.get();
+
+            ui_process_events(*info.input);
+            do_physics(*out, *in, *info.input, info.clock->step_length());
+
+            in = out;
+        }
 
-        ui_process_events(*info.input);
-        do_physics(*info.world_states[next_state], *info.world_states[info.current_physics_state], *info.input);
+        previous = latest;
+        latest   = next_state;
+        seq++;
 
-        info.current_physics_state = next_state;
+        info.publish_times[latest] = std::chrono::steady_clock::now();
+        info.published.store(pack_published(latest, previous, seq));
     }
 }
 
@@ -50,39 +133,86 @@ void main_loop(const std::string &scenario)
 {
     SharedInfo info;
 
-    std::unique_lock<std::mutex> lock(info.cgs_change_mtx);
-    lock.unlock();
-
-    info.current_graphics_state = 0;
-    info.current_physics_state  = 0;
-
     info.input = std::make_shared<Input>();
-    info.world_states.emplace_back(new WorldState);
-    info.world_states.emplace_back(new WorldState);
+    info.clock = std::make_shared<PhysicsClock>(global_options.physics_step);
+    for (int i = 0; i < WORLD_STATE_COUNT; i++) {
+        info.world_states.emplace_back(new WorldState);
+        info.readers[i].store(0);
+    }
 
     info.world_states[0]->initialize(scenario);
 
     // Do one step, because some values are actually not initialized by
     // "initialize".
     ui_process_events(*info.input);
-    do_physics(*info.world_states[1], *info.world_states[0], *info.input);
-    info.current_graphics_state = 1;
-    info.current_physics_state  = 1;
+    do_physics(*info.world_states[1], *info.world_states[0], *info.input,
+               info.clock->step_length());
+
+    info.publish_times[1] = std::chrono::steady_clock::now();
+    info.published.store(pack_published(1, 0, 0));
+    info.consumed_seq.store(UINT64_MAX);
 
     std::thread physics_thr(physics_worker, std::ref(info));
 
+    uint64_t last_drawn_seq = UINT64_MAX;
+
     while (!quit) {
         ui_fetch_events(*info.input);
-        do_graphics(*info.world_states[info.current_graphics_state]);
-        do_force_feedback(*info.world_states[info.current_graphics_state]);
-        do_sound(*info.world_states[info.current_graphics_state]);
 
-        lock.lock();
+        uint64_t published;
+        int latest, previous;
+
+        // Mark the states as being read, then check that they have not been
+        // replaced in the meantime (in which case the physics thread may
+        // already be overwriting one of them)
+        for (;;) {
+            published = info.published.load();
+            latest    =  published       & 0xff;
+            previous  = (published >> 8) & 0xff;
+
+            info.readers[latest]++;
+            info.readers[previous]++;
 
-        info.current_graphics_state = (info.current_graphics_state + 1) % 2;
-        info.cgs_change.notify_all();
+            if (info.published.load() == published) {
+                break;
+            }
+
+            info.readers[latest]--;
+            info.readers[previous]--;
+        }
+
+        uint64_t seq = published >> 16;
+        info.consumed_seq.store(seq);
+
+        const WorldState &latest_ws = *info.world_states[latest];
+
+        float since_latest =
+            std::chrono::duration_cast<std::chrono::duration<float>>
+                (std::chrono::steady_clock::now() - info.publish_times[latest])
+                .count();
+
+        // We are drawing one step behind, so that we can interpolate up to
+        // the latest state until the next one is ready
+        float alpha = latest_ws.real_interval
+                      ? since_latest / latest_ws.real_interval
+                      : 1.f;
+        if (alpha > 1.f) {
+            alpha = 1.f;
+        }
+
+        do_graphics(*info.world_states[previous], latest_ws, alpha);
+
+        // These are events, so they should not be repeated when drawing the
+        // same state multiple times
+        if (seq != last_drawn_seq) {
+            do_force_feedback(latest_ws);
+            do_sound(latest_ws);
+
+            last_drawn_seq = seq;
+        }
 
-        lock.unlock();
+        info.readers[latest]--;
+        info.readers[previous]--;
     }
 
     physics_thr.join();
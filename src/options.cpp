@@ -0,0 +1,101 @@
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "options.hpp"
+
+
+bool parse_common_option(int opt, const char *arg)
+{
+    switch (opt) {
+        case OPT_THREADS: {
+            char *endp;
+            errno = 0;
+            unsigned long threads = strtoul(arg, &endp, 0);
+            if (errno || !threads || (threads > 256) || *endp) {
+                fprintf(stderr, "Invalid argument given for --threads (1..256)\n");
+                return false;
+            }
+
+            global_options.job_threads = threads;
+            return true;
+        }
+
+        case OPT_MAX_PROJECTILES: {
+            char *endp;
+            errno = 0;
+            unsigned long count = strtoul(arg, &endp, 0);
+            if (errno || !count || (count > (1ul << 26)) || *endp) {
+                fprintf(stderr, "Invalid argument given for --max-projectiles (1..67108864)\n");
+                return false;
+            }
+
+            global_options.max_projectiles = count;
+            return true;
+        }
+
+        case OPT_PROJECTILE_EVICTION:
+            if (!strcmp(arg, "oldest")) {
+                global_options.projectile_eviction = Options::EVICT_OLDEST;
+            } else if (!strcmp(arg, "farthest")) {
+                global_options.projectile_eviction = Options::EVICT_FARTHEST;
+            } else if (!strcmp(arg, "out-of-range")) {
+                global_options.projectile_eviction = Options::EVICT_OUT_OF_RANGE;
+            } else {
+                fprintf(stderr, "Invalid argument given for --projectile-eviction (allowed: oldest, farthest, out-of-range)\n");
+                return false;
+            }
+            return true;
+
+        case OPT_DISABLE_AURORA:
+            global_options.aurora = false;
+            return true;
+
+        case OPT_AURORAS: {
+            char *endp;
+            errno = 0;
+            unsigned long count = strtoul(arg, &endp, 0);
+            if (errno || !count || (count > 16) || *endp) {
+                fprintf(stderr, "Invalid argument given for --auroras (1..16)\n");
+                return false;
+            }
+
+            global_options.auroras = count;
+            return true;
+        }
+
+        case OPT_AURORA_SAMPLES: {
+            char *endp;
+            errno = 0;
+            unsigned long count = strtoul(arg, &endp, 0);
+            if (errno || (count < 8) || (count > 4096) || *endp) {
+                fprintf(stderr, "Invalid argument given for --aurora-samples (8..4096)\n");
+                return false;
+            }
+
+            global_options.aurora_samples = count;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+
+void print_common_options_help(void)
+{
+    fprintf(stderr, "  --threads=N      Number of threads to use for physics (default: one per\n");
+    fprintf(stderr, "                   CPU core)\n");
+    fprintf(stderr, "  --max-projectiles=N\n");
+    fprintf(stderr, "                   Maximum number of projectiles in flight (default: 65536)\n");
+    fprintf(stderr, "  --projectile-eviction=<oldest,farthest,out-of-range>\n");
+    fprintf(stderr, "                   Which projectiles to remove when there are too many\n");
+    fprintf(stderr, "                   (oldest (default): those flying the longest; farthest:\n");
+    fprintf(stderr, "                   those farthest from any ship; out-of-range: the oldest of\n");
+    fprintf(stderr, "                   those out of any ship's radar range)\n");
+    fprintf(stderr, "  --disable-aurora Disables aurora borealis and australis\n");
+    fprintf(stderr, "  --auroras=N      Number of auroras to simulate (1..16; default: 3)\n");
+    fprintf(stderr, "  --aurora-samples=N\n");
+    fprintf(stderr, "                   Number of samples per aurora (8..4096; default: 128)\n");
+}
@@ -0,0 +1,201 @@
+#include <dake/math/fmatrix.hpp>
+#include <dake/gl.hpp>
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+
+#include "graphics.hpp"
+#include "particles.hpp"
+#include "physics.hpp"
+#include "streaming_buffer.hpp"
+
+
+using namespace dake;
+using namespace dake::math;
+
+
+// Particles whose projection is smaller than this (in pixels) are not drawn
+#define MIN_PARTICLE_PIXELS .5f
+
+
+static StreamingBuffer *particle_data, *impact_data;
+static gl::program *particle_prg, *impact_prg;
+static gl::texture *impact_tex;
+
+
+void init_particles(void)
+{
+    particle_prg = new gl::program {gl::shader::vert("shaders/particle_vert.glsl"),
+                                    gl::shader::geom("shaders/particle_geom.glsl"),
+                                    gl::shader::frag("shaders/particle_frag.glsl")};
+
+    particle_prg->bind_attrib("va_position", 0);
+    particle_prg->bind_attrib("va_orientation", 1);
+    particle_prg->bind_frag("out_col", 0);
+
+    particle_data = new StreamingBuffer(sizeof(ParticleGraphicsData), 4096);
+
+    particle_data->attrib(0, 3, GL_FLOAT,
+                          offsetof(ParticleGraphicsData,
+                                   position_relative_to_viewer));
+    particle_data->attrib(1, 3, GL_FLOAT,
+                          offsetof(ParticleGraphicsData, orientation));
+
+
+    impact_prg = new gl::program {gl::shader::vert("shaders/impact_vert.glsl"),
+                                  gl::shader::geom("shaders/impact_geom.glsl"),
+                                  gl::shader::frag("shaders/impact_frag.glsl")};
+
+    impact_prg->bind_attrib("va_position", 0);
+    impact_prg->bind_attrib("va_lifetime", 1);
+    impact_prg->bind_attrib("va_total_lifetime", 2);
+    impact_prg->bind_frag("out_col", 0);
+
+    impact_data = new StreamingBuffer(sizeof(ImpactGraphicsData), 256);
+
+    impact_data->attrib(0, 3, GL_FLOAT,
+                        offsetof(ImpactGraphicsData,
+                                 position_relative_to_viewer));
+    impact_data->attrib(1, 1, GL_FLOAT,
+                        offsetof(ImpactGraphicsData, lifetime));
+    impact_data->attrib(2, 1, GL_FLOAT,
+                        offsetof(ImpactGraphicsData, total_lifetime));
+
+    impact_tex = new gl::texture("assets/impact.png");
+    impact_tex->filter(GL_LINEAR);
+}
+
+
+// Writes those particles from @input to @output that are at least partially
+// in the view frustum and large enough to be seen; returns their number.
+static size_t cull_particles(ParticleGraphicsData *output,
+                             const InterpolatedState &input,
+                             const GraphicsStatus &status)
+{
+    fmat4 mvp = status.projection * status.relative_to_camera;
+
+    // Frustum planes (left, right, bottom, top, near, far) as (a, b, c, d)
+    // with a*x + b*y + c*z + d >= 0 inside, and (a, b, c) normalized
+    float planes[6][4];
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 4; j++) {
+            planes[2 * i    ][j] = mvp[j][3] + mvp[j][i];
+            planes[2 * i + 1][j] = mvp[j][3] - mvp[j][i];
+        }
+    }
+
+    for (float *plane: planes) {
+        float len = sqrtf(plane[0] * plane[0] + plane[1] * plane[1] +
+                          plane[2] * plane[2]);
+        for (int j = 0; j < 4; j++) {
+            plane[j] /= len;
+        }
+    }
+
+    // The geometry shader spans a quad of constant size in clip space around
+    // every particle; as seen from the camera, that is an object of constant
+    // size in world space
+    float quad_clip_radius = .5f * helper::maximum(1.f, status.aspect);
+    float proj_scale = status.projection[1][1];
+    float quad_world_radius = quad_clip_radius / proj_scale;
+
+    float half_height = .5f * status.height;
+
+    size_t count = 0;
+    for (const ParticleGraphicsData &pgd: input.pgd) {
+        // Bounding sphere of the streak from the position - orientation to
+        // the position
+        fvec3 center = pgd.position_relative_to_viewer - .5f * pgd.orientation;
+        float streak_radius = .5f * pgd.orientation.length();
+        float radius = streak_radius + quad_world_radius;
+
+        bool visible = true;
+        for (const float *plane: planes) {
+            if (plane[0] * center.x() + plane[1] * center.y() +
+                plane[2] * center.z() + plane[3] < -radius)
+            {
+                visible = false;
+                break;
+            }
+        }
+
+        if (!visible) {
+            continue;
+        }
+
+        float w = mvp[0][3] * center.x() + mvp[1][3] * center.y() +
+                  mvp[2][3] * center.z() + mvp[3][3];
+        if (w > 0.f && (quad_clip_radius + streak_radius * proj_scale) / w
+                       * half_height < MIN_PARTICLE_PIXELS)
+        {
+            continue;
+        }
+
+        output[count++] = pgd;
+    }
+
+    return count;
+}
+
+
+void draw_particles(const GraphicsStatus &status,
+                    const InterpolatedState &input)
+{
+    bool draw_p = input.pgd.size(), draw_i = input.igd.size();
+
+    if (!draw_p && !draw_i) {
+        return;
+    }
+
+    size_t p_first = 0, i_first = 0, p_count = 0;
+
+    if (draw_p) {
+        ParticleGraphicsData *mapping =
+            static_cast<ParticleGraphicsData *>(
+                particle_data->map(input.pgd.size()));
+
+        p_count = cull_particles(mapping, input, status);
+        p_first = particle_data->unmap(p_count);
+
+        draw_p = p_count;
+    }
+
+    if (draw_i) {
+        memcpy(impact_data->map(input.igd.size()), input.igd.data(),
+               input.igd.size() * sizeof(ImpactGraphicsData));
+        i_first = impact_data->unmap(input.igd.size());
+    }
+
+    glEnable(GL_BLEND);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
+    glDepthMask(GL_FALSE);
+    glDisable(GL_CULL_FACE);
+
+    if (draw_p) {
+        particle_prg->use();
+
+        particle_prg->uniform<fmat4>("mat_mvp") = status.projection
+                                                  * status.relative_to_camera;
+        particle_prg->uniform<float>("aspect") = status.aspect;
+
+        particle_data->draw(GL_POINTS, p_first, p_count);
+    }
+
+
+    if (draw_i) {
+        // TODO: Bindless
+        impact_tex->bind();
+
+        impact_prg->use();
+
+        impact_prg->uniform<fmat4>("mat_mv") = status.relative_to_camera;
+        impact_prg->uniform<fmat4>("mat_proj") = status.projection;
+        impact_prg->uniform<gl::texture>("tex") = *impact_tex;
+
+        impact_data->draw(GL_POINTS, i_first, input.igd.size());
+    }
+
+
+    glEnable(GL_CULL_FACE);
+}
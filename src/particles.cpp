@@ -1,353 +1,842 @@
 #include <dake/math/fmatrix.hpp>
-#include <dake/gl.hpp>
 
+#include <algorithm>
 #include <cmath>
+#include <cstddef>
+#include <cstdint>
 #include <cstdlib>
+#include <functional>
+#include <vector>
 
-#include "graphics.hpp"
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+#include "jobs.hpp"
+#include "options.hpp"
 #include "particles.hpp"
 #include "physics.hpp"
+#include "radar.hpp"
+#include "runge-kutta-4.hpp"
 #include "ship.hpp"
+#include "ship_types.hpp"
+#include "spatial_grid.hpp"
 
 
-using namespace dake;
 using namespace dake::math;
 
 
-static gl::vertex_array *particle_data, *impact_data;
-static gl::program *particle_prg, *impact_prg;
-static gl::texture *impact_tex;
-
-
-void init_particles(void)
+void ParticleNonGraphicsData::resize(size_t count)
 {
-    particle_prg = new gl::program {gl::shader::vert("shaders/particle_vert.glsl"),
-                                    gl::shader::geom("shaders/particle_geom.glsl"),
-                                    gl::shader::frag("shaders/particle_frag.glsl")};
+    for (AlignedVector<double> *v: { &pos_x, &pos_y, &pos_z }) {
+        v->resize(count);
+    }
 
-    particle_prg->bind_attrib("va_position", 0);
-    particle_prg->bind_attrib("va_orientation", 1);
-    particle_prg->bind_frag("out_col", 0);
+    for (AlignedVector<float> *v: { &vel_x, &vel_y, &vel_z, &lifetime }) {
+        v->resize(count);
+    }
 
-    particle_data = new gl::vertex_array;
+    source_ship_id.resize(count);
+    weapon_class.resize(count);
+}
 
-    particle_data->attrib(0)->format(3);
-    particle_data->attrib(1)->format(3);
-    particle_data->attrib(1)->reuse_buffer(particle_data->attrib(0));
 
+void ParticleNonGraphicsData::reserve(size_t count)
+{
+    for (AlignedVector<double> *v: { &pos_x, &pos_y, &pos_z }) {
+        v->reserve(count);
+    }
 
-    impact_prg = new gl::program {gl::shader::vert("shaders/impact_vert.glsl"),
-                                  gl::shader::geom("shaders/impact_geom.glsl"),
-                                  gl::shader::frag("shaders/impact_frag.glsl")};
+    for (AlignedVector<float> *v: { &vel_x, &vel_y, &vel_z, &lifetime }) {
+        v->reserve(count);
+    }
 
-    impact_prg->bind_attrib("va_position", 0);
-    impact_prg->bind_attrib("va_lifetime", 1);
-    impact_prg->bind_attrib("va_total_lifetime", 2);
-    impact_prg->bind_frag("out_col", 0);
+    source_ship_id.reserve(count);
+    weapon_class.reserve(count);
+}
 
-    impact_data = new gl::vertex_array;
 
-    impact_data->attrib(0)->format(3);
-    impact_data->attrib(1)->format(1);
-    impact_data->attrib(1)->reuse_buffer(impact_data->attrib(0));
-    impact_data->attrib(2)->format(1);
-    impact_data->attrib(2)->reuse_buffer(impact_data->attrib(0));
+void ParticleNonGraphicsData::push_back(const fvec3d &position,
+                                        const fvec3 &velocity,
+                                        float lifetime_s, uint64_t source,
+                                        const WeaponClass *weapon)
+{
+    pos_x.push_back(position.x());
+    pos_y.push_back(position.y());
+    pos_z.push_back(position.z());
 
-    impact_tex = new gl::texture("assets/impact.png");
-    impact_tex->filter(GL_LINEAR);
+    vel_x.push_back(velocity.x());
+    vel_y.push_back(velocity.y());
+    vel_z.push_back(velocity.z());
+
+    lifetime.push_back(lifetime_s);
+    source_ship_id.push_back(source);
+    weapon_class.push_back(weapon);
 }
 
 
 void spawn_particle(WorldState &output, const ShipState &sender,
+                    const WeaponClass *weapon,
                     const fvec3d &position, const fvec3 &velocity,
                     const fvec3 &orientation)
 {
-    output.new_particles.pgd.emplace_back();
+    // May be called from multiple jobs at once, so every job slot has its own
+    // list
+    Particles &new_particles = output.new_particles[job_slot()];
+
+    new_particles.pgd.emplace_back();
 
-    ParticleGraphicsData &pgd = output.new_particles.pgd.back();
+    ParticleGraphicsData &pgd = new_particles.pgd.back();
     pgd.orientation = orientation;
 
+    new_particles.pngd.push_back(position, velocity,
+                                 weapon->projectile_lifetime, sender.id,
+                                 weapon);
+}
 
-    output.new_particles.pngd.emplace_back();
 
-    ParticleNonGraphicsData &pngd = output.new_particles.pngd.back();
-    pngd.position = position;
-    pngd.velocity = velocity;
-    pngd.lifetime = 120.f;
-    pngd.source_ship_id = sender.id;
+// Copies particle @i from @in to @out_i in @out, where its position relative
+// to the viewer is @rel
+static inline void copy_particle(Particles &out, size_t out_i,
+                                 const Particles &in, size_t i,
+                                 double x, double y, double z,
+                                 float vx, float vy, float vz, float lifetime,
+                                 const fvec3 &rel)
+{
+    ParticleNonGraphicsData &opngd = out.pngd;
+
+    opngd.pos_x[out_i] = x;
+    opngd.pos_y[out_i] = y;
+    opngd.pos_z[out_i] = z;
+    opngd.vel_x[out_i] = vx;
+    opngd.vel_y[out_i] = vy;
+    opngd.vel_z[out_i] = vz;
+    opngd.lifetime[out_i] = lifetime;
+    opngd.source_ship_id[out_i] = in.pngd.source_ship_id[i];
+    opngd.weapon_class[out_i] = in.pngd.weapon_class[i];
+
+    out.pgd[out_i].position_relative_to_viewer = rel;
+    out.pgd[out_i].orientation = in.pgd[i].orientation;
 }
 
 
-void handle_particles(Particles &output, const Particles &input,
-                      WorldState &out_ws, const ShipState &player)
+// Applies gravity to the input particles [@begin, @end), moves them, and writes
+// those which are still alive to @output starting at @out_begin (which must be
+// large enough to hold all of them).  Returns the number of particles written;
+// the largest squared speed among them is stored in @max_speed2.
+static size_t step_particles(Particles &output, size_t out_begin,
+                             const Particles &input, size_t begin, size_t end,
+                             float interval, const fvec3d &cam_pos,
+                             float *max_speed2)
 {
-    size_t out_i = 0;
+    const ParticleNonGraphicsData &in = input.pngd;
 
-    fvec3d cam_pos = player.position +
-                     fmat3(player.right, player.up, player.forward)
-                     * player.ship->cockpit_position;
+    size_t i = begin, out_i = out_begin;
+    float mv2 = 0.f;
 
-    size_t isz = input.pgd.size(), osz = output.pgd.size();
+#ifdef __AVX__
+    __m256d neg_gm = _mm256_set1_pd(-EARTH_GM);
+    __m128 vdt = _mm_set1_ps(interval);
+    __m256d cam_x = _mm256_set1_pd(cam_pos.x());
+    __m256d cam_y = _mm256_set1_pd(cam_pos.y());
+    __m256d cam_z = _mm256_set1_pd(cam_pos.z());
+    __m128 vmv2 = _mm_setzero_ps();
 
-    for (size_t i = 0; i < isz; i++) {
-        const ParticleGraphicsData &pgd = input.pgd[i];
-        const ParticleNonGraphicsData &pngd = input.pngd[i];
+    for (; i + 4 <= end; i += 4) {
+        __m128 lt = _mm_sub_ps(_mm_loadu_ps(&in.lifetime[i]), vdt);
+        __m128 alive_mask = _mm_cmpgt_ps(lt, _mm_setzero_ps());
+        int alive = _mm_movemask_ps(alive_mask);
 
-        float new_lifetime = pngd.lifetime - out_ws.interval;
-
-        if (new_lifetime <= 0.f) {
+        if (!alive) {
             continue;
         }
 
-        if (osz <= out_i) {
-            output.pgd.emplace_back();
-            output.pngd.emplace_back();
-
-            osz++;
+        __m256d px = _mm256_loadu_pd(&in.pos_x[i]);
+        __m256d py = _mm256_loadu_pd(&in.pos_y[i]);
+        __m256d pz = _mm256_loadu_pd(&in.pos_z[i]);
+
+        __m256d r2 = _mm256_add_pd(_mm256_mul_pd(px, px),
+                                   _mm256_add_pd(_mm256_mul_pd(py, py),
+                                                 _mm256_mul_pd(pz, pz)));
+        __m256d factor = _mm256_div_pd(neg_gm,
+                                       _mm256_mul_pd(r2, _mm256_sqrt_pd(r2)));
+
+        __m128 gx = _mm256_cvtpd_ps(_mm256_mul_pd(px, factor));
+        __m128 gy = _mm256_cvtpd_ps(_mm256_mul_pd(py, factor));
+        __m128 gz = _mm256_cvtpd_ps(_mm256_mul_pd(pz, factor));
+
+        __m128 vx = _mm_add_ps(_mm_loadu_ps(&in.vel_x[i]), _mm_mul_ps(gx, vdt));
+        __m128 vy = _mm_add_ps(_mm_loadu_ps(&in.vel_y[i]), _mm_mul_ps(gy, vdt));
+        __m128 vz = _mm_add_ps(_mm_loadu_ps(&in.vel_z[i]), _mm_mul_ps(gz, vdt));
+
+        __m128 v2 = _mm_add_ps(_mm_mul_ps(vx, vx),
+                               _mm_add_ps(_mm_mul_ps(vy, vy),
+                                          _mm_mul_ps(vz, vz)));
+        vmv2 = _mm_max_ps(vmv2, _mm_and_ps(v2, alive_mask));
+
+        px = _mm256_add_pd(px, _mm256_cvtps_pd(_mm_mul_ps(vx, vdt)));
+        py = _mm256_add_pd(py, _mm256_cvtps_pd(_mm_mul_ps(vy, vdt)));
+        pz = _mm256_add_pd(pz, _mm256_cvtps_pd(_mm_mul_ps(vz, vdt)));
+
+        __m128 rx = _mm256_cvtpd_ps(_mm256_sub_pd(px, cam_x));
+        __m128 ry = _mm256_cvtpd_ps(_mm256_sub_pd(py, cam_y));
+        __m128 rz = _mm256_cvtpd_ps(_mm256_sub_pd(pz, cam_z));
+
+        alignas(32) double ox[4], oy[4], oz[4];
+        alignas(16) float ovx[4], ovy[4], ovz[4], olt[4];
+        alignas(16) float orx[4], ory[4], orz[4];
+
+        _mm256_store_pd(ox, px);
+        _mm256_store_pd(oy, py);
+        _mm256_store_pd(oz, pz);
+        _mm_store_ps(ovx, vx);
+        _mm_store_ps(ovy, vy);
+        _mm_store_ps(ovz, vz);
+        _mm_store_ps(olt, lt);
+        _mm_store_ps(orx, rx);
+        _mm_store_ps(ory, ry);
+        _mm_store_ps(orz, rz);
+
+        // The graphics data is an array of structures, so compaction does not
+        // really cost anything extra here
+        for (int j = 0; j < 4; j++) {
+            if (alive & (1 << j)) {
+                copy_particle(output, out_i++, input, i + j,
+                              ox[j], oy[j], oz[j], ovx[j], ovy[j], ovz[j],
+                              olt[j], fvec3(orx[j], ory[j], orz[j]));
+            }
         }
-
-        fvec3 gravitation = -pngd.position *
-                            6.67384e-11 * 5.974e24
-                            / pow(pngd.position.length(), 3.);
-
-        ParticleGraphicsData &opgd = output.pgd[out_i];
-        ParticleNonGraphicsData &opngd = output.pngd[out_i];
-        out_i++;
-
-        opngd.velocity = pngd.velocity + gravitation * out_ws.interval;
-        opngd.position = pngd.position + opngd.velocity * out_ws.interval;
-        opngd.lifetime = new_lifetime;
-        opngd.source_ship_id = pngd.source_ship_id;
-
-        opgd.position_relative_to_viewer = fvec3(opngd.position - cam_pos);
-        opgd.orientation = pgd.orientation;
     }
 
-    size_t nsz = out_ws.new_particles.pgd.size();
-
-    for (size_t i = 0; i < nsz; i++) {
-        const ParticleGraphicsData &pgd = out_ws.new_particles.pgd[i];
-        const ParticleNonGraphicsData &pngd = out_ws.new_particles.pngd[i];
+    alignas(16) float omv2[4];
+    _mm_store_ps(omv2, vmv2);
+    mv2 = std::max(std::max(omv2[0], omv2[1]), std::max(omv2[2], omv2[3]));
+#endif
 
-        if (osz <= out_i) {
-            output.pgd.emplace_back();
-            output.pngd.emplace_back();
+    for (; i < end; i++) {
+        float new_lifetime = in.lifetime[i] - interval;
 
-            osz++;
+        if (new_lifetime <= 0.f) {
+            continue;
         }
 
-        ParticleGraphicsData &opgd = output.pgd[out_i];
-        ParticleNonGraphicsData &opngd = output.pngd[out_i];
-        out_i++;
+        double px = in.pos_x[i], py = in.pos_y[i], pz = in.pos_z[i];
+        double r2 = px * px + py * py + pz * pz;
+        double factor = -EARTH_GM / (r2 * sqrt(r2));
 
-        opngd.velocity = pngd.velocity;
-        opngd.position = pngd.position;
-        opngd.lifetime = pngd.lifetime;
-        opngd.source_ship_id = pngd.source_ship_id;
+        float vx = in.vel_x[i] + static_cast<float>(px * factor) * interval;
+        float vy = in.vel_y[i] + static_cast<float>(py * factor) * interval;
+        float vz = in.vel_z[i] + static_cast<float>(pz * factor) * interval;
 
-        opgd.position_relative_to_viewer = fvec3(opngd.position - cam_pos);
-        opgd.orientation = pgd.orientation;
-    }
+        px += vx * interval;
+        py += vy * interval;
+        pz += vz * interval;
 
-    out_ws.new_particles.pgd.clear();
-    out_ws.new_particles.pngd.clear();
+        mv2 = std::max(mv2, vx * vx + vy * vy + vz * vz);
 
-    if (out_i < osz) {
-        output.pgd.resize(out_i);
-        output.pngd.resize(out_i);
+        copy_particle(output, out_i++, input, i, px, py, pz, vx, vy, vz,
+                      new_lifetime,
+                      fvec3(static_cast<float>(px - cam_pos.x()),
+                            static_cast<float>(py - cam_pos.y()),
+                            static_cast<float>(pz - cam_pos.z())));
     }
 
+    *max_speed2 = mv2;
+    return out_i - out_begin;
+}
 
-    size_t impact_out_i = 0;
 
-    size_t impact_isz = input.igd.size(), impact_osz = output.igd.size();
+// Moves the impacts [@begin, @end) of @input and writes those which are still
+// alive to @output starting at @out_begin.  Returns the number written.
+static size_t step_impacts(Particles &output, size_t out_begin,
+                           const Particles &input, size_t begin, size_t end,
+                           float interval, const fvec3d &cam_pos)
+{
+    size_t out_i = out_begin;
 
-    for (size_t i = 0; i < impact_isz; i++) {
+    for (size_t i = begin; i < end; i++) {
         const ImpactGraphicsData &igd = input.igd[i];
         const ImpactNonGraphicsData &ingd = input.ingd[i];
 
-        float new_lifetime = igd.lifetime - out_ws.interval;
+        float new_lifetime = igd.lifetime - interval;
 
         if (new_lifetime <= 0.f) {
             continue;
         }
 
-        if (impact_osz <= impact_out_i) {
-            output.igd.emplace_back();
-            output.ingd.emplace_back();
-
-            impact_osz++;
-        }
+        double r2 = ingd.position.dot(ingd.position);
+        fvec3 gravitation = fvec3(ingd.position *
+                                  (-EARTH_GM / (r2 * sqrt(r2))));
 
-        fvec3 gravitation = -ingd.position *
-                            6.67384e-11 * 5.974e24
-                            / pow(ingd.position.length(), 3.);
-
-        ImpactGraphicsData &oigd = output.igd[impact_out_i];
-        ImpactNonGraphicsData &oingd = output.ingd[impact_out_i];
-        impact_out_i++;
+        ImpactGraphicsData &oigd = output.igd[out_i];
+        ImpactNonGraphicsData &oingd = output.ingd[out_i];
+        out_i++;
 
-        oingd.velocity = ingd.velocity + gravitation * out_ws.interval;
-        oingd.position = ingd.position + oingd.velocity * out_ws.interval;
+        oingd.velocity = ingd.velocity + gravitation * interval;
+        oingd.position = ingd.position + oingd.velocity * interval;
 
         oigd.position_relative_to_viewer = fvec3(oingd.position - cam_pos);
         oigd.lifetime = new_lifetime;
         oigd.total_lifetime = igd.total_lifetime;
     }
 
+    return out_i - out_begin;
+}
 
-#define HITBOX_RADIUS 1.f
 
-    // TODO: Put particle and ship positions into a kd tree to reduce collision
-    // testing complexity
-    for (size_t i = 0; i < out_i; i++) {
-        ParticleNonGraphicsData &pngd = output.pngd[i];
+#define COMPACTION_CHUNK_SIZE 1024
 
-        for (ShipState &s: out_ws.ships) {
-            fvec3 movement = -out_ws.interval * pngd.velocity;
-            float mvsq = movement.dot(movement);
-            float dist_end = (pngd.position - s.position).length();
+// Filters @count elements in parallel: Every chunk is first passed to
+// @count_alive(begin, end), which returns how many of its elements are to be
+// kept.  Then @write(begin, end, out_begin) writes those kept starting at
+// out_begin, which is where the previous chunks' elements end.  Returns the
+// total number of elements kept.
+static size_t parallel_compact(size_t count,
+                               const std::function<size_t(size_t, size_t)>
+                                   &count_alive,
+                               const std::function<void(size_t, size_t,
+                                                        size_t)> &write)
+{
+    size_t chunks = (count + COMPACTION_CHUNK_SIZE - 1) / COMPACTION_CHUNK_SIZE;
 
-            if (dist_end < HITBOX_RADIUS + sqrtf(mvsq) &&
-                pngd.source_ship_id != s.id)
-            {
-                // Find nearest point
-                float t = (s.position - pngd.position).dot(movement) / mvsq;
-                float min_dist;
+    // offsets[c + 1] is first the number of elements kept in chunk c, then
+    // (after the prefix sum) the end of its output
+    std::vector<size_t> offsets(chunks + 1);
 
-                min_dist = (pngd.position + t * movement - s.position).length();
+    parallel_for(chunks, 1, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++) {
+            offsets[c + 1] =
+                count_alive(c * COMPACTION_CHUNK_SIZE,
+                            std::min((c + 1) * COMPACTION_CHUNK_SIZE, count));
+        }
+    });
 
-                if (min_dist <= HITBOX_RADIUS) {
-                    float dist_start =
-                        (pngd.position + movement - s.position).length();
+    for (size_t c = 0; c < chunks; c++) {
+        offsets[c + 1] += offsets[c];
+    }
 
-                    if ((t >= 0.f && t <= 1.f) ||
-                        dist_end <= HITBOX_RADIUS ||
-                        dist_start <= HITBOX_RADIUS)
-                    {
-                        pngd.lifetime = 0.f;
-                        s.deal_damage(10.f);
+    parallel_for(chunks, 1, [&](size_t begin, size_t end) {
+        for (size_t c = begin; c < end; c++) {
+            write(c * COMPACTION_CHUNK_SIZE,
+                  std::min((c + 1) * COMPACTION_CHUNK_SIZE, count),
+                  offsets[c]);
+        }
+    });
 
-                        if (impact_osz <= impact_out_i) {
-                            output.igd.emplace_back();
-                            output.ingd.emplace_back();
+    return offsets[chunks];
+}
 
-                            impact_osz++;
-                        }
 
-                        ImpactGraphicsData &oigd = output.igd[impact_out_i];
-                        ImpactNonGraphicsData &oingd = output.ingd[impact_out_i];
-                        impact_out_i++;
-
-                        oingd.velocity = s.velocity;
-                        if (t >= 0.f && t <= 1.f) {
-                            oingd.position = pngd.position + t * movement;
-                        } else if (dist_end <= HITBOX_RADIUS) {
-                            oingd.position = pngd.position;
-                        } else /* if (dist_start <= HITBOX_RADIUS) */ {
-                            oingd.position = pngd.position + movement;
-                        }
+// Removes @count of the first @size particles in @ps as determined by
+// global_options.projectile_eviction, keeping the order of the others (which
+// is the order they were spawned in).  @range_grid is a grid over the ships in
+// @ws with a cell size of RADAR_RANGE.  Returns the number of particles left.
+static size_t evict_particles(Particles &ps, size_t size, size_t count,
+                              const WorldState &ws,
+                              const SpatialGrid &range_grid)
+{
+    // Non-zero for every particle to be removed
+    static std::vector<uint8_t> evict;
+    evict.assign(size, 0);
+
+    if (global_options.projectile_eviction == Options::EVICT_OLDEST) {
+        std::fill(evict.begin(), evict.begin() + count, 1);
+    } else {
+        // Squared distance to the nearest ship within radar range, or infinity
+        // if there is none (all of those count as equally far away).  Only
+        // the cells around every particle need to be checked for that.
+        static std::vector<float> distance;
+        static std::vector<std::vector<uint32_t>> candidate_lists;
+
+        distance.resize(size);
+        if (candidate_lists.size() != static_cast<size_t>(job_slot_count())) {
+            candidate_lists.resize(job_slot_count());
+        }
+
+        float range2 = RADAR_RANGE * RADAR_RANGE;
+        fvec3d range(RADAR_RANGE, RADAR_RANGE, RADAR_RANGE);
+
+        parallel_for(size, 256, [&](size_t begin, size_t end) {
+            std::vector<uint32_t> &candidates = candidate_lists[job_slot()];
 
-                        oigd.position_relative_to_viewer = fvec3(oingd.position
-                                                                 - cam_pos);
-                        if (s.hull_hitpoints <= 0.f) {
-                            oigd.total_lifetime = 10.f;
-                        } else {
-                            oigd.total_lifetime = 2.f;
+            for (size_t i = begin; i < end; i++) {
+                fvec3d position = ps.pngd.position(i);
+                float min_dist = HUGE_VALF;
+
+                candidates.clear();
+                if (!range_grid.query(position - range, position + range,
+                                      &candidates))
+                {
+                    for (size_t j = 0; j < ws.ships.size(); j++) {
+                        if (ws.ships[j].alive) {
+                            candidates.push_back(j);
                         }
-                        oigd.lifetime = oigd.total_lifetime;
                     }
                 }
+
+                for (uint32_t ship_index: candidates) {
+                    fvec3d rel = ws.ship_table.position(ship_index) - position;
+                    float dist = static_cast<float>(rel.dot(rel));
+
+                    if (dist < range2) {
+                        min_dist = std::min(min_dist, dist);
+                    }
+                }
+
+                distance[i] = min_dist;
+            }
+        });
+
+        if (global_options.projectile_eviction == Options::EVICT_FARTHEST) {
+            static std::vector<uint32_t> order;
+            order.resize(size);
+            for (size_t i = 0; i < size; i++) {
+                order[i] = i;
+            }
+
+            // Farthest first, oldest first among those equally far away
+            std::nth_element(order.begin(), order.begin() + count, order.end(),
+                             [](uint32_t a, uint32_t b) {
+                                 return distance[a] != distance[b]
+                                        ? distance[a] > distance[b]
+                                        : a < b;
+                             });
+
+            for (size_t i = 0; i < count; i++) {
+                evict[order[i]] = 1;
+            }
+        } else /* EVICT_OUT_OF_RANGE */ {
+            size_t evicted = 0;
+
+            for (size_t i = 0; i < size && evicted < count; i++) {
+                if (distance[i] == HUGE_VALF) {
+                    evict[i] = 1;
+                    evicted++;
+                }
+            }
+
+            // Not enough; fall back to the oldest of the rest
+            for (size_t i = 0; i < size && evicted < count; i++) {
+                if (!evict[i]) {
+                    evict[i] = 1;
+                    evicted++;
+                }
             }
         }
     }
 
+    size_t out_i = 0;
+    for (size_t i = 0; i < size; i++) {
+        if (evict[i]) {
+            continue;
+        }
+
+        if (out_i != i) {
+            const ParticleNonGraphicsData &pngd = ps.pngd;
 
-    if (impact_out_i < impact_osz) {
-        output.igd.resize(impact_out_i);
-        output.ingd.resize(impact_out_i);
+            copy_particle(ps, out_i, ps, i,
+                          pngd.pos_x[i], pngd.pos_y[i], pngd.pos_z[i],
+                          pngd.vel_x[i], pngd.vel_y[i], pngd.vel_z[i],
+                          pngd.lifetime[i],
+                          ps.pgd[i].position_relative_to_viewer);
+        }
+        out_i++;
     }
-}
 
+    return out_i;
+}
 
-void draw_particles(const GraphicsStatus &status, const Particles &input)
-{
-    bool draw_p = input.pgd.size(), draw_i = input.igd.size();
 
-    if (!draw_p && !draw_i) {
-        return;
+// Spheres (i.e. ship hitboxes) to test a single particle against, as
+// structure of arrays
+struct SphereBatch {
+    void clear(void)
+    {
+        x.clear(); y.clear(); z.clear(); r2.clear(); ship.clear();
     }
 
-    if (draw_p) {
-        particle_data->set_elements(input.pgd.size());
+    void push_back(const fvec3 &center, float radius, uint32_t ship_index)
+    {
+        x.push_back(center.x());
+        y.push_back(center.y());
+        z.push_back(center.z());
+        r2.push_back(radius * radius);
+        ship.push_back(ship_index);
     }
-    if (draw_i) {
-        impact_data->set_elements(input.igd.size());
+
+    // Center relative to the particle's current position
+    AlignedVector<float> x, y, z;
+    // Squared radius
+    AlignedVector<float> r2;
+
+    AlignedVector<uint32_t> ship;
+};
+
+
+// Tests a particle that has moved to its current position from there plus
+// @movement against all spheres in @b.  Sets @hit[i] to 1 if sphere i has been
+// touched anywhere along the way, or 0 otherwise.
+static void swept_sphere_test(const SphereBatch &b, const fvec3 &movement,
+                              uint8_t *hit)
+{
+    size_t count = b.ship.size(), i = 0;
+    float mvsq = movement.dot(movement);
+
+    // With d being the center relative to the particle, t the parameter of the
+    // point on the movement line nearest to the center, and all distances
+    // squared: The line has to come close enough to the center, and either
+    // that point has to be on the segment or one of the ends has to be inside
+    // of the sphere.  (If mvsq is 0, t is NaN, and nothing is hit.)
+#ifdef __AVX__
+    __m256 mx = _mm256_set1_ps(movement.x());
+    __m256 my = _mm256_set1_ps(movement.y());
+    __m256 mz = _mm256_set1_ps(movement.z());
+    __m256 vmvsq = _mm256_set1_ps(mvsq);
+    __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.f);
+
+    for (; i + 8 <= count; i += 8) {
+        __m256 dx = _mm256_loadu_ps(&b.x[i]);
+        __m256 dy = _mm256_loadu_ps(&b.y[i]);
+        __m256 dz = _mm256_loadu_ps(&b.z[i]);
+        __m256 r2 = _mm256_loadu_ps(&b.r2[i]);
+
+        __m256 dist_end = _mm256_add_ps(_mm256_mul_ps(dx, dx),
+                                        _mm256_add_ps(_mm256_mul_ps(dy, dy),
+                                                      _mm256_mul_ps(dz, dz)));
+        __m256 dm = _mm256_add_ps(_mm256_mul_ps(dx, mx),
+                                  _mm256_add_ps(_mm256_mul_ps(dy, my),
+                                                _mm256_mul_ps(dz, mz)));
+        __m256 t = _mm256_div_ps(dm, vmvsq);
+
+        __m256 min_dist = _mm256_sub_ps(dist_end, _mm256_mul_ps(dm, t));
+        __m256 dist_start = _mm256_add_ps(_mm256_sub_ps(dist_end,
+                                                        _mm256_add_ps(dm, dm)),
+                                          vmvsq);
+
+        __m256 on_segment = _mm256_and_ps(_mm256_cmp_ps(t, zero, _CMP_GE_OQ),
+                                          _mm256_cmp_ps(t, one, _CMP_LE_OQ));
+        __m256 close = _mm256_or_ps(on_segment,
+                           _mm256_or_ps(_mm256_cmp_ps(dist_end, r2, _CMP_LE_OQ),
+                                        _mm256_cmp_ps(dist_start, r2,
+                                                      _CMP_LE_OQ)));
+        int mask = _mm256_movemask_ps(
+                       _mm256_and_ps(_mm256_cmp_ps(min_dist, r2, _CMP_LE_OQ),
+                                     close));
+
+        for (int j = 0; j < 8; j++) {
+            hit[i + j] = (mask >> j) & 1;
+        }
     }
+#endif
+
+    for (; i < count; i++) {
+        float dist_end = b.x[i] * b.x[i] + b.y[i] * b.y[i] + b.z[i] * b.z[i];
+        float dm = b.x[i] * movement.x() + b.y[i] * movement.y() +
+                   b.z[i] * movement.z();
+        float t = dm / mvsq;
 
-    if (draw_p) {
-        particle_data->attrib(0)->data(input.pgd.data(),
-                                       input.pgd.size()
-                                       * sizeof(ParticleGraphicsData),
-                                       GL_DYNAMIC_DRAW, false);
+        float min_dist = dist_end - dm * t;
+        float dist_start = dist_end - (dm + dm) + mvsq;
+
+        hit[i] = min_dist <= b.r2[i] &&
+                 ((t >= 0.f && t <= 1.f) ||
+                  dist_end <= b.r2[i] || dist_start <= b.r2[i]);
     }
+}
+
+
+// A hit found by handle_particles(), before it is applied
+struct PendingHit {
+    // Index of the particle and of the ship hit in the ship list
+    size_t particle;
+    uint32_t ship;
+
+    HitEvent event;
+};
+
+
+// Per job slot state for handle_particles()
+struct CollisionScratch {
+    std::vector<uint32_t> candidates;
+    SphereBatch spheres;
+    AlignedVector<uint8_t> hits;
+
+    std::vector<PendingHit> pending;
+};
+
+
+static fvec3d camera_position(const WorldState &ws, const ShipState &player)
+{
+    const ShipTable &t = ws.ship_table;
+    size_t slot = ship_id_slot(player.id);
+
+    return t.position(slot) +
+           fmat3(t.right(slot), t.up(slot), t.forward(slot))
+           * player.ship->cockpit_position;
+}
+
+
+void move_particles(Particles &output, const Particles &input,
+                    const WorldState &out_ws, const ShipState &player)
+{
+    fvec3d cam_pos = camera_position(out_ws, player);
+    float interval = out_ws.interval;
+
+    size_t isz = input.pngd.size();
+
+    // The pool never grows beyond this, so allocate everything once
+    size_t capacity = global_options.max_projectiles;
 
-    if (draw_i) {
-        impact_data->attrib(0)->data(input.igd.data(),
-                                     input.igd.size()
-                                     * sizeof(ImpactGraphicsData),
-                                     GL_DYNAMIC_DRAW, false);
+    output.pgd.reserve(capacity);
+    output.pngd.reserve(capacity);
+
+    // The input cannot exceed the capacity, so neither can this
+    output.pgd.resize(isz);
+    output.pngd.resize(isz);
+
+    // Maximum per job slot, reduced afterwards
+    static std::vector<float> max_speed2;
+    max_speed2.assign(job_slot_count(), 0.f);
+
+    size_t out_i = parallel_compact(isz,
+        [&](size_t begin, size_t end) {
+            size_t alive = 0;
+            for (size_t i = begin; i < end; i++) {
+                alive += input.pngd.lifetime[i] - interval > 0.f;
+            }
+            return alive;
+        },
+        [&](size_t begin, size_t end, size_t out_begin) {
+            float mv2;
+            step_particles(output, out_begin, input, begin, end,
+                           interval, cam_pos, &mv2);
+
+            float &slot_mv2 = max_speed2[job_slot()];
+            slot_mv2 = std::max(slot_mv2, mv2);
+        });
+
+    output.pgd.resize(out_i);
+    output.pngd.resize(out_i);
+
+    output.max_speed = sqrtf(*std::max_element(max_speed2.begin(),
+                                               max_speed2.end()));
+
+
+    size_t impact_isz = input.igd.size();
+
+    output.igd.resize(impact_isz);
+    output.ingd.resize(impact_isz);
+
+    size_t impact_out_i = parallel_compact(impact_isz,
+        [&](size_t begin, size_t end) {
+            size_t alive = 0;
+            for (size_t i = begin; i < end; i++) {
+                alive += input.igd[i].lifetime - interval > 0.f;
+            }
+            return alive;
+        },
+        [&](size_t begin, size_t end, size_t out_begin) {
+            step_impacts(output, out_begin, input, begin, end,
+                         interval, cam_pos);
+        });
+
+    output.igd.resize(impact_out_i);
+    output.ingd.resize(impact_out_i);
+}
+
+
+void handle_particles(Particles &output, WorldState &out_ws,
+                      const ShipState &player, const SpatialGrid &range_grid)
+{
+    fvec3d cam_pos = camera_position(out_ws, player);
+    float interval = out_ws.interval;
+
+    size_t out_i = output.pngd.size(), new_count = 0;
+    for (const Particles &new_particles: out_ws.new_particles) {
+        new_count += new_particles.pngd.size();
     }
 
-    if (draw_p) {
-        particle_data->attrib(0)->load(sizeof(ParticleGraphicsData),
-                                       offsetof(ParticleGraphicsData,
-                                                position_relative_to_viewer));
-        particle_data->attrib(1)->load(sizeof(ParticleGraphicsData),
-                                       offsetof(ParticleGraphicsData,
-                                                orientation));
+    size_t capacity = global_options.max_projectiles;
+
+    // If even the new particles alone do not fit, skip the first ones of them
+    size_t new_skip = new_count > capacity ? new_count - capacity : 0;
+
+    if (out_i + new_count - new_skip > capacity) {
+        out_i = evict_particles(output, out_i,
+                                out_i + new_count - new_skip - capacity,
+                                out_ws, range_grid);
     }
 
-    if (draw_i) {
-        impact_data->attrib(0)->load(sizeof(ImpactGraphicsData),
-                                     offsetof(ImpactGraphicsData,
-                                              position_relative_to_viewer));
-        impact_data->attrib(1)->load(sizeof(ImpactGraphicsData),
-                                       offsetof(ImpactGraphicsData, lifetime));
-        impact_data->attrib(2)->load(sizeof(ImpactGraphicsData),
-                                       offsetof(ImpactGraphicsData,
-                                                total_lifetime));
+    output.pgd.resize(out_i + new_count - new_skip);
+    output.pngd.resize(out_i + new_count - new_skip);
+
+    // Particles spawned by any job slot during this step
+    for (Particles &new_particles: out_ws.new_particles) {
+        const ParticleNonGraphicsData &pngd = new_particles.pngd;
+        size_t nsz = pngd.size();
+
+        size_t skip = std::min(new_skip, nsz);
+        new_skip -= skip;
+
+        for (size_t i = skip; i < nsz; i++) {
+            copy_particle(output, out_i++, new_particles, i,
+                          pngd.pos_x[i], pngd.pos_y[i], pngd.pos_z[i],
+                          pngd.vel_x[i], pngd.vel_y[i], pngd.vel_z[i],
+                          pngd.lifetime[i],
+                          fvec3(pngd.position(i) - cam_pos));
+
+            output.max_speed = std::max(output.max_speed,
+                                        pngd.velocity(i).length());
+        }
+
+        new_particles.pgd.clear();
+        new_particles.pngd.resize(0);
     }
 
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE);
-    glDepthMask(GL_FALSE);
-    glDisable(GL_CULL_FACE);
 
-    if (draw_p) {
-        particle_prg->use();
+    out_ws.hit_events.clear();
 
-        particle_prg->uniform<fmat4>("mat_mvp") = status.projection
-                                                  * status.relative_to_camera;
-        particle_prg->uniform<float>("aspect") = status.aspect;
 
-        particle_data->draw(GL_POINTS);
+#define MIN_GRID_CELL_SIZE 1000.
+#define MAX_GRID_CELL_SIZE 100e3
+
+    // Hitboxes around the ships are spheres; every particle's segment has to
+    // be enlarged by the largest of them for the broadphase
+    float max_hitbox_radius = 0.f;
+    for (const ShipState &s: out_ws.ships) {
+        if (s.alive) {
+            max_hitbox_radius = std::max(max_hitbox_radius,
+                                         s.ship->hitbox_radius);
+        }
     }
 
+    // Make the cells as large as the longest distance any particle has moved
+    // (so most segments fit into a single cell), but no larger than
+    // MAX_GRID_CELL_SIZE: With time acceleration or fast projectiles, cells
+    // that large would put all ships into the same few cells.  Longer segments
+    // are walked in pieces instead (see SpatialGrid::query_segment()).
+    double cell_size = interval * output.max_speed + max_hitbox_radius;
+    cell_size = std::min(std::max(cell_size, MIN_GRID_CELL_SIZE),
+                         MAX_GRID_CELL_SIZE);
+    // query_segment() needs the hitbox radius to be at most half a cell
+    cell_size = std::max(cell_size, 2. * max_hitbox_radius);
+
+    // Only accessed from the physics thread
+    static SpatialGrid ship_grid;
+    static std::vector<CollisionScratch> scratch;
+
+    ship_grid.build(out_ws.ships, out_ws.ship_table, cell_size);
+
+    if (scratch.size() != static_cast<size_t>(job_slot_count())) {
+        scratch.resize(job_slot_count());
+    }
+
+    ParticleNonGraphicsData &pngd = output.pngd;
+
+    // Only records hits, so the particles can be checked in parallel; the
+    // ships are left alone until all of them are done
+    parallel_for(out_i, 256, [&](size_t begin, size_t end) {
+        CollisionScratch &cs = scratch[job_slot()];
+
+        for (size_t i = begin; i < end; i++) {
+            fvec3d position = pngd.position(i);
+            fvec3 movement = -interval * pngd.velocity(i);
+
+            cs.candidates.clear();
+            ship_grid.query_segment(position, position + movement,
+                                    max_hitbox_radius, &cs.candidates);
+
+            cs.spheres.clear();
+            for (uint32_t ship_index: cs.candidates) {
+                const ShipState &s = out_ws.ships[ship_index];
+
+                if (s.id != pngd.source_ship_id[i]) {
+                    fvec3d ship_pos = out_ws.ship_table.position(ship_index);
+                    cs.spheres.push_back(fvec3(ship_pos - position),
+                                         s.ship->hitbox_radius, ship_index);
+                }
+            }
+
+            if (cs.spheres.ship.empty()) {
+                continue;
+            }
+
+            cs.hits.resize(cs.spheres.ship.size());
+            swept_sphere_test(cs.spheres, movement, cs.hits.data());
+
+            for (size_t j = 0; j < cs.spheres.ship.size(); j++) {
+                if (!cs.hits[j]) {
+                    continue;
+                }
+
+                pngd.lifetime[i] = 0.f;
+
+                // Point on the segment nearest to the ship (clamped to the
+                // segment, which is where swept_sphere_test() found the hit)
+                fvec3 rel(cs.spheres.x[j], cs.spheres.y[j], cs.spheres.z[j]);
+                float t = rel.dot(movement) / movement.dot(movement);
+
+                PendingHit ph;
+                ph.particle = i;
+                ph.ship = cs.spheres.ship[j];
+
+                ph.event.source_ship_id = pngd.source_ship_id[i];
+                ph.event.target_ship_id = out_ws.ships[ph.ship].id;
+                ph.event.weapon = pngd.weapon_class[i];
 
-    if (draw_i) {
-        // TODO: Bindless
-        impact_tex->bind();
+                if (t >= 0.f && t <= 1.f) {
+                    ph.event.position = position + t * movement;
+                } else if (rel.dot(rel) <= cs.spheres.r2[j]) {
+                    ph.event.position = position;
+                } else {
+                    ph.event.position = position + movement;
+                }
 
-        impact_prg->use();
+                cs.pending.push_back(ph);
+            }
+        }
+    });
 
-        impact_prg->uniform<fmat4>("mat_mv") = status.relative_to_camera;
-        impact_prg->uniform<fmat4>("mat_proj") = status.projection;
-        impact_prg->uniform<gl::texture>("tex") = *impact_tex;
 
-        impact_data->draw(GL_POINTS);
+    // Which job slot got which particles is up to chance, so sort the hits to
+    // apply them in the same order every time
+    static std::vector<PendingHit> pending;
+    pending.clear();
+    for (CollisionScratch &cs: scratch) {
+        pending.insert(pending.end(), cs.pending.begin(), cs.pending.end());
+        cs.pending.clear();
     }
 
+    std::sort(pending.begin(), pending.end(),
+              [](const PendingHit &x, const PendingHit &y) {
+                  return x.particle != y.particle ? x.particle < y.particle
+                                                  : x.ship < y.ship;
+              });
+
+    size_t impact_out_i = output.igd.size();
+    output.igd.resize(impact_out_i + pending.size());
+    output.ingd.resize(impact_out_i + pending.size());
+
+    for (const PendingHit &ph: pending) {
+        ShipState &s = out_ws.ships[ph.ship];
 
-    glEnable(GL_CULL_FACE);
+        s.deal_damage(ph.event.weapon->damage);
+
+        ImpactGraphicsData &oigd = output.igd[impact_out_i];
+        ImpactNonGraphicsData &oingd = output.ingd[impact_out_i];
+        impact_out_i++;
+
+        oingd.position = ph.event.position;
+        oingd.velocity = out_ws.ship_table.velocity(ph.ship);
+
+        oigd.position_relative_to_viewer = fvec3(oingd.position - cam_pos);
+        if (s.hull_hitpoints <= 0.f) {
+            oigd.total_lifetime = 10.f;
+        } else {
+            oigd.total_lifetime = 2.f;
+        }
+        oigd.lifetime = oigd.total_lifetime;
+
+        out_ws.hit_events.push_back(ph.event);
+    }
 }
@@ -1,17 +1,24 @@
+#include <algorithm>
 #include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <ctime>
 #include <functional>
+#include <utility>
+#include <vector>
 
 #include <dake/math.hpp>
 
 #include "generic-data.hpp"
+#include "jobs.hpp"
 #include "json.hpp"
 #include "options.hpp"
 #include "physics.hpp"
 #include "runge-kutta-4.hpp"
 #include "ship_types.hpp"
 #include "software.hpp"
+#include "spatial_grid.hpp"
+#include "sweep_and_prune.hpp"
 #include "weapons.hpp"
 
 
@@ -23,7 +30,8 @@ static bool player_fixed_to_ground = false;
 static float fixed_to_ground_length = 0.f; // FIXME
 
 
-static inline float time_interval(const std::chrono::system_clock::duration &d)
+template<typename Duration>
+static inline float time_interval(const Duration &d)
 {
     using namespace std::chrono;
 
@@ -40,13 +48,25 @@ static inline std::chrono::system_clock::duration
 }
 
 
+static fmat4 earth_matrix(float earth_angle)
+{
+    return fmat4::scaling(fvec3(6371e3f, 6371e3f, 6371e3f))
+                 .rotated_normalized(.41f, fvec3(1.f, 0.f, 0.f))
+                 .rotated_normalized(earth_angle, fvec3(0.f, 1.f, 0.f));
+}
+
+
 static void handle_weapons(WorldState &output, const WorldState &input,
-                           const Input &user_input,
-                           ShipState &ship_out, const ShipState &ship_in,
+                           const Input &user_input, size_t slot,
                            fvec3 *weapon_force, fvec3 *weapon_torque)
 {
+    const ShipState &ship_in = input.ships[slot];
+    ShipState &ship_out = output.ships[slot];
+    const ShipEquipment &eq_in = input.ship_equipment[slot];
+    ShipEquipment &eq_out = output.ship_equipment[slot];
+
     int weapon_count = static_cast<int>(ship_in.ship->weapons.size());
-    bool is_player_ship = &ship_in == &input.ships[input.player_ship];
+    bool is_player_ship = static_cast<int>(slot) == input.player_ship;
     bool local_mat_initialized = false;
     fmat3 local_mat;
 
@@ -58,35 +78,33 @@ static void handle_weapons(WorldState &output, const WorldState &input,
         aim_yn = user_input.get_mapping("aim.-y");
 
         for (int i = 0; i < weapon_count; i++) {
-            ship_out.weapon_forwards[i] = fvec3(aim_xp - aim_xn,
-                                                aim_yp - aim_yn,
-                                                -1.f).approx_normalized();
+            eq_out.weapon_forwards[i] = fvec3(aim_xp - aim_xn,
+                                              aim_yp - aim_yn,
+                                              -1.f).approx_normalized();
         }
     }
 
     for (int i = 0; i < weapon_count; i++) {
         bool fire = false;
 
-        float new_cooldown = ship_in.weapon_cooldowns[i] - output.interval;
+        float new_cooldown = eq_in.weapon_cooldowns[i] - output.interval;
 
         if (new_cooldown <= 0.f) {
             fire = is_player_ship && user_input.get_mapping("main_fire");
             if (fire) {
                 WeaponType wt = ship_in.ship->weapons[i].type;
                 const WeaponClass *wc = weapon_classes[wt];
+                const ShipTable &t = output.ship_table;
 
                 if (!local_mat_initialized) {
-                    local_mat[0] = ship_out.right;
-                    local_mat[1] = ship_out.up;
-                    local_mat[2] = -ship_out.forward;
-
+                    local_mat = t.local_matrix(slot);
                     local_mat_initialized = true;
                 }
 
-                fvec3 fwd(local_mat * ship_out.weapon_forwards[i]);
+                fvec3 fwd(local_mat * eq_out.weapon_forwards[i]);
 
-                spawn_particle(output, ship_out, ship_out.position,
-                               fvec3(ship_out.velocity +
+                spawn_particle(output, ship_out, wc, t.position(slot),
+                               fvec3(t.velocity(slot) +
                                      fwd * wc->projectile_velocity),
                                fwd * 20.f);
 
@@ -98,8 +116,8 @@ static void handle_weapons(WorldState &output, const WorldState &input,
             new_cooldown = 0.f;
         }
 
-        ship_out.weapon_cooldowns[i] = new_cooldown;
-        ship_out.weapon_fired[i] = fire;
+        eq_out.weapon_cooldowns[i] = new_cooldown;
+        eq_out.weapon_fired[i] = fire;
     }
 
     // TODO
@@ -108,15 +126,417 @@ static void handle_weapons(WorldState &output, const WorldState &input,
 }
 
 
-void do_physics(WorldState &output, const WorldState &input, const Input &user_input)
+static void load_ship_table(WorldState &output, const WorldState &input,
+                            size_t i)
+{
+    const ShipState &in = input.ships[i];
+    ShipState &out = output.ships[i];
+    const ShipTable &in_t = input.ship_table;
+    ShipTable &t = output.ship_table;
+
+    if (!in.alive) {
+        // Free slot.  A script may have spawned a ship there during this step
+        // already, so its state must be left alone; marking the slot as on
+        // rails keeps the integration away from it.
+        t.torque_x[i] = t.torque_y[i] = t.torque_z[i] = 0.f;
+        t.mass[i] = 1.f;
+        t.on_rails[i] = true;
+        return;
+    }
+
+    t.copy_state(i, in_t);
+
+    t.mass[i] = in.total_mass;
+
+    // Sum up in the ship's local space and transform only the result (as
+    // local_mat is a rotation, transforming both lever arm and force before
+    // taking their cross product gives the same torque)
+    fvec3 force = fvec3::zero(), torque = fvec3::zero();
+    const auto &thrusters = out.ship->thrusters;
+    const auto &thruster_states = output.ship_equipment[i].thruster_states;
+    for (size_t j = 0; j < thrusters.size(); j++) {
+        float state = thruster_states[j];
+        if (state < 0.f) {
+            state = 0.f;
+        } else if (state > 1.f) {
+            state = 1.f;
+        }
+
+        force  += state * thrusters[j].force;
+        torque += state * thrusters[j].relative_position
+                                      .cross(thrusters[j].force);
+    }
+
+    fmat3 local_mat(in_t.local_matrix(i));
+
+    force  = local_mat * force  + in.weapon_force;
+    torque = local_mat * torque + in.weapon_torque;
+
+    fvec3 accel = force / in.total_mass;
+
+    t.acc_x[i] = accel.x();
+    t.acc_y[i] = accel.y();
+    t.acc_z[i] = accel.z();
+
+    t.torque_x[i] = torque.x();
+    t.torque_y[i] = torque.y();
+    t.torque_z[i] = torque.z();
+
+    // If only gravity acts on the ship, it can follow its orbit analytically.
+    // Keep using the orbit from the last step as long as the ship is exactly
+    // where that put it (i.e. nothing else like a collision or a script has
+    // moved it).
+    if (!accel.x() && !accel.y() && !accel.z()) {
+        fvec3d position = in_t.position(i), velocity = in_t.velocity(i);
+
+        if (in.orbit.matches(position, velocity)) {
+            out.orbit = in.orbit;
+        } else {
+            out.orbit.from_state(position, velocity);
+        }
+    } else {
+        out.orbit.valid = false;
+    }
+
+    t.on_rails[i] = out.orbit.valid;
+}
+
+
+static void integrate_ship_table(ShipTable &t, float interval,
+                                 size_t begin, size_t end)
+{
+    // Integrate every run of ships that are not on rails as one batch
+    for (size_t run_begin = begin; run_begin < end;) {
+        if (t.on_rails[run_begin]) {
+            run_begin++;
+            continue;
+        }
+
+        size_t run_end = run_begin + 1;
+        while (run_end < end && !t.on_rails[run_end]) {
+            run_end++;
+        }
+
+        RK4Batch batch = {
+            t.pos_x.data() + run_begin, t.pos_y.data() + run_begin,
+            t.pos_z.data() + run_begin,
+            t.vel_x.data() + run_begin, t.vel_y.data() + run_begin,
+            t.vel_z.data() + run_begin,
+            t.acc_x.data() + run_begin, t.acc_y.data() + run_begin,
+            t.acc_z.data() + run_begin
+        };
+
+        // RK4 is accurate enough for short steps, but error grows quickly
+        // (with the fifth power of the step length) and e.g. a low orbit
+        // cannot be integrated in 100 s steps anymore
+        if (interval > 10.f) {
+            dopri5_integrate_earth_gravity(batch, run_end - run_begin,
+                                           interval);
+        } else {
+            rk4_integrate_earth_gravity(batch, run_end - run_begin, interval);
+        }
+
+        run_begin = run_end;
+    }
+
+    for (size_t i = begin; i < end; i++) {
+        t.ang_mom_x[i] += t.torque_x[i] * interval;
+        t.ang_mom_y[i] += t.torque_y[i] * interval;
+        t.ang_mom_z[i] += t.torque_z[i] * interval;
+    }
+}
+
+
+static void finish_ship_step(WorldState &output, const WorldState &input,
+                             const Input &user_input, int i,
+                             bool physics_enabled)
+{
+    const ShipState &in = input.ships[i];
+    ShipState &out = output.ships[i];
+    const ShipTable &in_t = input.ship_table;
+    ShipTable &t = output.ship_table;
+
+    fvec3d in_position = in_t.position(i), in_velocity = in_t.velocity(i);
+    fvec3d position, velocity;
+    fvec3 angular_momentum;
+
+    fvec3 forward = in_t.forward(i), up = in_t.up(i), right = in_t.right(i);
+    fmat3 local_mat(in_t.local_matrix(i));
+
+
+    if (physics_enabled) {
+        velocity = t.velocity(i);
+        position = t.position(i);
+
+        out.acceleration = (velocity - in_velocity) / output.interval;
+        out.torque       = fvec3(t.torque_x[i], t.torque_y[i], t.torque_z[i]);
+    } else {
+        if (player_fixed_to_ground) {
+            fvec3 tangent = crossp(fvec3(input.earth_mv * fvec4(0.f, 1.f, 0.f, 0.f)),
+                                   fvec3(in_position)).normalized();
+            fvec3 sphere_pos = (input.earth_inv_mv *
+                                fvec4::direction(in_position).normalized());
+            sphere_pos.y() = 0.f;
+            fvec3 earth_velocity = sphere_pos.length() * 6371e3f * 2.f * M_PIf / 86164.09f * tangent;
+
+            velocity = earth_velocity;
+
+            if (!fixed_to_ground_length) {
+                fixed_to_ground_length = in_position.length();
+            }
+            position = output.earth_mv *
+                       (input.earth_inv_mv *
+                        fvec4::direction(in_position));
+            position = position.normalized() * fixed_to_ground_length;
+        } else {
+            velocity = fvec3d::zero();
+            position = in_position;
+        }
+
+        out.acceleration = fvec3::zero();
+        out.torque = fvec3::zero();
+    }
+
+    // FIXME if player_fixed_to_ground (the orientation is just kept then)
+
+    if (physics_enabled && position.length() < 6371e3f) {
+        fvec3 earth_normal = position.normalized();
+        velocity = .8 * (velocity -
+                         2. * velocity.dot(earth_normal) *
+                        fvec3d(earth_normal));
+        position = 6371e3 / position.length() * position;
+    }
+
+    if (physics_enabled && t.on_rails[i]) {
+        out.orbit_normal = out.orbit.q.cross(out.orbit.p);
+    } else {
+        out.orbit_normal = velocity.cross(position).normalized();
+        out.orbit.valid = false;
+    }
+
+    if (physics_enabled) {
+        angular_momentum        = t.angular_momentum(i);
+        out.rotational_velocity = angular_momentum / in.total_mass;
+    } else {
+        angular_momentum        = fvec3::zero();
+        out.rotational_velocity = fvec3::zero();
+    }
+
+    if (physics_enabled && in.rotational_velocity.length()) {
+        fmat3 rot_mat(fmat3::rotation(in.rotational_velocity.length()
+                                      * output.interval,
+                                      in.rotational_velocity));
+        // right   = (rot_mat * right).normalized();
+        up      = (rot_mat * up).normalized();
+        forward = (rot_mat * forward).normalized();
+
+        right = forward.cross(up);
+        up    = right.cross(forward);
+    }
+
+    t.set_position(i, position);
+    t.set_velocity(i, velocity);
+    t.set_angular_momentum(i, angular_momentum);
+    t.set_orientation(i, forward, up, right);
+
+    // .transpose() == .invert() (local_mat is a rotation matrix)
+    local_mat.transpose();
+    out.local_velocity            = local_mat * velocity;
+    out.local_acceleration        = local_mat * out.acceleration;
+    out.local_rotational_velocity = local_mat * out.rotational_velocity;
+    out.local_orbit_normal        = local_mat * out.orbit_normal;
+
+    out.hull_hitpoints = in.hull_hitpoints;
+
+
+    handle_weapons(output, input, user_input, i,
+                   &out.weapon_force, &out.weapon_torque);
+}
+
+
+// Steps all ships in [begin, end), all of which must have physics enabled
+static void step_ships(WorldState &output, const WorldState &input,
+                       const Input &user_input, size_t begin, size_t end)
+{
+    ShipTable &t = output.ship_table;
+
+    for (size_t i = begin; i < end; i++) {
+        load_ship_table(output, input, i);
+    }
+
+    integrate_ship_table(t, output.interval, begin, end);
+
+    for (size_t i = begin; i < end; i++) {
+        if (!t.on_rails[i] || !input.ships[i].alive) {
+            continue;
+        }
+
+        KeplerOrbit &orbit = output.ships[i].orbit;
+        orbit.propagate(output.interval);
+
+        t.pos_x[i] = orbit.position.x();
+        t.pos_y[i] = orbit.position.y();
+        t.pos_z[i] = orbit.position.z();
+
+        t.vel_x[i] = orbit.velocity.x();
+        t.vel_y[i] = orbit.velocity.y();
+        t.vel_z[i] = orbit.velocity.z();
+    }
+
+    for (size_t i = begin; i < end; i++) {
+        if (input.ships[i].alive) {
+            finish_ship_step(output, input, user_input, i, true);
+        }
+    }
+}
+
+
+// Fraction of the velocity along the contact normal that ships keep when
+// bumping into each other
+#define SHIP_RESTITUTION .5
+
+
+// Updates everything derived from a ship's position and velocity after a
+// collision has changed them
+static void ship_collided(ShipState &s, const ShipTable &t, size_t i)
+{
+    fvec3d velocity = t.velocity(i);
+
+    s.orbit.valid = false;
+    s.orbit_normal = velocity.cross(t.position(i)).normalized();
+
+    // .transpose() == .invert() (local_mat is a rotation matrix)
+    fmat3 local_mat(t.local_matrix(i));
+    local_mat.transpose();
+    s.local_velocity     = local_mat * velocity;
+    s.local_orbit_normal = local_mat * s.orbit_normal;
+}
+
+
+// Separates ships whose hitboxes overlap and lets them bounce off each other
+static void handle_ship_collisions(WorldState &output)
+{
+    // Only accessed from the physics thread
+    static SweepAndPrune sap;
+    static std::vector<std::pair<uint32_t, uint32_t>> pairs;
+
+    ShipTable &t = output.ship_table;
+
+    pairs.clear();
+    sap.update(output.ships, t, &pairs);
+
+    for (const std::pair<uint32_t, uint32_t> &pair: pairs) {
+        ShipState &a = output.ships[pair.first];
+        ShipState &b = output.ships[pair.second];
+
+        fvec3d pos_a = t.position(pair.first), pos_b = t.position(pair.second);
+        fvec3d vel_a = t.velocity(pair.first), vel_b = t.velocity(pair.second);
+
+        fvec3d d = pos_b - pos_a;
+        double dist = d.length();
+        double radius_sum = a.ship->hitbox_radius + b.ship->hitbox_radius;
+
+        if (dist >= radius_sum || !dist) {
+            continue;
+        }
+
+        // The player ship stays where it is while its physics are disabled
+        double inv_mass_a = 1. / a.total_mass, inv_mass_b = 1. / b.total_mass;
+        if (!player_physics_enabled) {
+            if (static_cast<int>(pair.first) == output.player_ship) {
+                inv_mass_a = 0.;
+            } else if (static_cast<int>(pair.second) == output.player_ship) {
+                inv_mass_b = 0.;
+            }
+        }
+
+        double inv_mass_sum = inv_mass_a + inv_mass_b;
+        fvec3d normal = (1. / dist) * d;
+
+        // Push them apart so they just touch
+        double penetration = radius_sum - dist;
+        t.set_position(pair.first,
+                       pos_a - penetration * inv_mass_a / inv_mass_sum
+                               * normal);
+        t.set_position(pair.second,
+                       pos_b + penetration * inv_mass_b / inv_mass_sum
+                               * normal);
+
+        // Only if they are still approaching each other
+        double approach = (vel_b - vel_a).dot(normal);
+        if (approach < 0.) {
+            double impulse = -(1. + SHIP_RESTITUTION) * approach
+                             / inv_mass_sum;
+
+            t.set_velocity(pair.first,  vel_a - impulse * inv_mass_a * normal);
+            t.set_velocity(pair.second, vel_b + impulse * inv_mass_b * normal);
+        }
+
+        ship_collided(a, t, pair.first);
+        ship_collided(b, t, pair.second);
+    }
+}
+
+
+PhysicsClock::PhysicsClock(float step_length):
+    last_tick(std::chrono::steady_clock::now()),
+    fixed_step(step_length),
+    // Nominal length for a step run before the first tick()
+    cur_step(step_length ? step_length : 1.f / 60.f)
+{}
+
+
+int PhysicsClock::tick(void)
 {
-    output.real_timestamp = std::chrono::system_clock::now();
-    output.real_interval  = time_interval(output.real_timestamp - input.real_timestamp);
+    auto now = std::chrono::steady_clock::now();
+    float elapsed = time_interval(now - last_tick);
+    last_tick = now;
+
+    if (!fixed_step) {
+        cur_step = elapsed > .1f ? .1f : elapsed;
+        return 1;
+    }
+
+    accumulator += elapsed;
+
+    int steps = static_cast<int>(accumulator / fixed_step);
+
+    // If we cannot keep up, drop the backlog instead of spending ever more
+    // time on catching up
+    if (steps > 8) {
+        steps = 8;
+        accumulator = 0.f;
+    } else {
+        accumulator -= steps * fixed_step;
+    }
+
+    return steps;
+}
+
+
+float PhysicsClock::time_to_next_step(void) const
+{
+    if (!fixed_step) {
+        return 0.f;
+    }
+
+    float elapsed = time_interval(std::chrono::steady_clock::now() - last_tick);
+    float remaining = fixed_step - accumulator - elapsed;
+
+    return remaining > 0.f ? remaining : 0.f;
+}
+
+
+void do_physics(WorldState &output, const WorldState &input,
+                const Input &user_input, float real_interval)
+{
+    output.real_interval = real_interval;
+    output.sim_time      = input.sim_time + real_interval;
 
     output.time_speed_up = input.time_speed_up;
 
     if (user_input.get_mapping("time_acceleration") &&
-        output.time_speed_up < 1000)
+        output.time_speed_up < 100000)
     {
         output.time_speed_up *= 10;
     }
@@ -131,12 +551,7 @@ void do_physics(WorldState &output, const WorldState &input, const Input &user_i
         time_accel = 0.f;
     }
 
-    float limited_real_interval = output.real_interval;
-    if (limited_real_interval > .1f) {
-        limited_real_interval = .1f;
-    }
-
-    output.interval  = limited_real_interval * time_accel;
+    output.interval  = output.real_interval * time_accel;
     output.timestamp = input.timestamp + interval_duration(output.interval);
 
     output.scenario = input.scenario;
@@ -172,208 +587,232 @@ void do_physics(WorldState &output, const WorldState &input, const Input &user_i
     output.earth_angle  = second_of_day / 86164.09f * 2.f * M_PIf;
     output.earth_angle -= year_angle;
 
-    output.earth_mv = fmat4::scaling(fvec3(6371e3f, 6371e3f, 6371e3f))
-                             .rotated_normalized(.41f, fvec3(1.f, 0.f, 0.f))
-                             .rotated_normalized(output.earth_angle,
-                                                 fvec3(0.f, 1.f, 0.f));
+    output.earth_mv     = earth_matrix(output.earth_angle);
     output.earth_inv_mv = output.earth_mv.inverse();
 
 
-    if (input.ship_list_changed) {
-        output.ships = input.ships;
-        output.player_ship = input.player_ship;
-        output.ship_list_changed = false;
-    }
+    output.sync_ship_layout(input);
 
 
-    ShipState &player = output.ships[output.player_ship];
-    execute_flight_control_software(player, user_input, output.interval);
-
-
-    for (const ShipState &in: input.ships) {
-        int i = &in - input.ships.data();
-        ShipState &out = output.ships[i];
+    if (output.new_particles.size() != static_cast<size_t>(job_slot_count())) {
+        output.new_particles.resize(job_slot_count());
+    }
 
-        // Positive Z is backwards
-        fmat3 local_mat(in.right, in.up, -in.forward);
 
+    execute_flight_control_software(output.ship_equipment[output.player_ship],
+                                    input.ships[input.player_ship],
+                                    user_input, output.interval);
 
-        bool physics_enabled = player_physics_enabled || i != input.player_ship;
 
-        if (physics_enabled) {
-            fvec3 forces = fvec3::zero(), torque = fvec3::zero();
-            for (size_t j = 0; j < out.ship->thrusters.size(); j++) {
-                float state = out.thruster_states[j];
-                if (state < 0.f) {
-                    state = 0.f;
-                } else if (state > 1.f) {
-                    state = 1.f;
-                }
+    // The player ship is handled on its own: Its physics may be replaced by
+    // the scenario script, and that may spawn new ships (thus reallocating
+    // output.ships), so nothing else may touch the ship list meanwhile.
+    if (player_physics_enabled) {
+        step_ships(output, input, user_input,
+                   input.player_ship, input.player_ship + 1);
+    } else {
+        finish_ship_step(output, input, user_input, input.player_ship, false);
+    }
 
-                fvec3 force = state * (local_mat * out.ship->thrusters[j].force);
+    if (!player_physics_enabled && input.scenario_initialized) {
+        input.scenario->sub<ScenarioScript>().execute(output, input, user_input);
+    }
 
-                forces += force;
-                torque += fvec3(local_mat *
-                                out.ship->thrusters[j].relative_position)
-                          .cross(force);
+    // Moving the existing particles does not depend on any ship but the player,
+    // so it can be done in the background while the others are stepped
+    JobGroup particle_jobs;
+    particle_jobs.run([&output, &input](void) {
+            move_particles(output.particles, input.particles, output,
+                           output.ships[output.player_ship]);
+        });
+
+    // All other ships only depend on their own input state, with the
+    // exception of spawning particles (for which every job slot has its own
+    // list)
+    parallel_for(input.ships.size(), 32,
+        [&](size_t begin, size_t end) {
+            size_t player = input.player_ship;
+
+            if (player >= begin && player < end) {
+                step_ships(output, input, user_input, begin, player);
+                step_ships(output, input, user_input, player + 1, end);
+            } else {
+                step_ships(output, input, user_input, begin, end);
             }
+        });
 
-            forces += in.weapon_force;
-            torque += in.weapon_torque;
 
-            fvec3 accel = forces / in.total_mass;
-
-            auto rk4_calc_accel = [&accel](const RK4State &state) -> fvec3 {
-                fvec3 total_accel = accel;
-                if (state.x.length() > 6371e3) {
-                    total_accel += state.x * (-6.67384e-11 * 5.974e24)
-                                   / pow(state.x.length(), 3.);
-                }
-                return total_accel;
-            };
+    particle_jobs.wait();
 
-            RK4State rk4_initial(in.position, in.velocity);
-            RK4State rk4s = rk4_integrate(rk4_initial, output.interval,
-                                          rk4_calc_accel);
+    // Needs all ships to have been stepped, and may move the player (which
+    // move_particles() reads)
+    handle_ship_collisions(output);
 
-            out.acceleration = (rk4s.v - in.velocity) / output.interval;
-            out.torque       = torque;
+    // Ships do not move anymore after this point, so this grid serves both
+    // the particles and the radars.  Only accessed from the physics thread.
+    static SpatialGrid range_grid;
+    range_grid.build(output.ships, output.ship_table, RADAR_RANGE);
 
-            out.velocity = rk4s.v;
-            out.position = rk4s.x;
-        } else {
-            if (player_fixed_to_ground) {
-                fvec3 tangent = crossp(fvec3(input.earth_mv * fvec4(0.f, 1.f, 0.f, 0.f)),
-                                       fvec3(in.position)).normalized();
-                fvec3 sphere_pos = (input.earth_inv_mv *
-                                    fvec4::direction(in.position).normalized());
-                sphere_pos.y() = 0.f;
-                fvec3 earth_velocity = sphere_pos.length() * 6371e3f * 2.f * M_PIf / 86164.09f * tangent;
-
-                out.velocity = earth_velocity;
-
-                if (!fixed_to_ground_length) {
-                    fixed_to_ground_length = in.position.length();
+    ShipState &player = output.ships[output.player_ship];
+    handle_particles(output.particles, output, player, range_grid);
+
+
+    // Every ship's radar only reads the ship list, so they can all be updated
+    // at the same time
+    parallel_for(input.ships.size(), 16,
+        [&](size_t begin, size_t end) {
+            for (size_t i = begin; i < end; i++) {
+                // Skip free slots and ships spawned during this step
+                if (!output.ships[i].alive ||
+                    output.ships[i].id != input.ships[i].id)
+                {
+                    continue;
                 }
-                out.position = output.earth_mv *
-                               (input.earth_inv_mv *
-                                fvec4::direction(in.position));
-                out.position = out.position.normalized() * fixed_to_ground_length;
-            } else {
-                out.velocity = fvec3d::zero();
-                out.position = in.position;
-            }
-
-            out.acceleration = fvec3::zero();
-            out.torque = fvec3::zero();
-        }
 
-        if (!physics_enabled) {
-            // FIXME if player_fixed_to_ground
-            out.forward = in.forward;
-            out.right   = in.right;
-            out.up      = in.up;
-        }
+                output.radars[i].update(input.radars[i], output.ships[i],
+                                        output, range_grid, user_input);
+            }
+        });
 
-        if (!physics_enabled && input.scenario_initialized) {
-            input.scenario->sub<ScenarioScript>().execute(output, input, user_input);
-        }
 
-        if (physics_enabled && out.position.length() < 6371e3f) {
-            fvec3 earth_normal = out.position.normalized();
-            out.velocity = .8 * (out.velocity -
-                                 2. * out.velocity.dot(earth_normal) *
-                                fvec3d(earth_normal));
-            out.position = 6371e3 / out.position.length() * out.position;
+    // The player ship stays, though, because too much depends on it
+    for (size_t i = 0; i < output.ships.size(); i++) {
+        if (output.ships[i].alive && output.ships[i].hull_hitpoints <= 0.f &&
+            static_cast<int>(i) != output.player_ship)
+        {
+            output.despawn_ship(i);
         }
+    }
 
-        out.orbit_normal = out.velocity.cross(out.position).normalized();
 
-        if (physics_enabled) {
-            out.angular_momentum    = in.angular_momentum + out.torque * output.interval;
-            out.rotational_velocity = out.angular_momentum / in.total_mass;
-        } else {
-            out.angular_momentum    = fvec3::zero();
-            out.rotational_velocity = fvec3::zero();
+    if (global_options.aurora) {
+        if (!output.auroras.size()) {
+            output.auroras.resize(input.auroras.size());
         }
 
-        if (physics_enabled) {
-            if (in.rotational_velocity.length()) {
-                fmat3 rot_mat(fmat3::rotation(in.rotational_velocity.length()
-                                              * output.interval,
-                                              in.rotational_velocity));
-                // out.right   = (rot_mat * in.right).normalized();
-                out.up      = (rot_mat * in.up).normalized();
-                out.forward = (rot_mat * in.forward).normalized();
-
-                out.right = out.forward.cross(out.up);
-                out.up    = out.right.cross(out.forward);
-            } else {
-                out.right   = in.right;
-                out.up      = in.up;
-                out.forward = in.forward;
-            }
+        JobGroup aurora_jobs;
+        for (size_t i = 0; i < output.auroras.size(); i++) {
+            aurora_jobs.run([&output, &input, i](void) {
+                    output.auroras[i].step(input.auroras[i],
+                                           input.aurora_hotspots, output);
+                });
         }
 
-        // .transpose() == .invert() (local_mat is a rotation matrix)
-        local_mat.transpose();
-        out.local_velocity            = local_mat * out.velocity;
-        out.local_acceleration        = local_mat * out.acceleration;
-        out.local_rotational_velocity = local_mat * out.rotational_velocity;
-        out.local_orbit_normal        = local_mat * out.orbit_normal;
-
-        out.hull_hitpoints = in.hull_hitpoints;
-
-
-        handle_weapons(output, input, user_input, out, in,
-                       &out.weapon_force, &out.weapon_torque);
+        output.aurora_hotspots.step(input.aurora_hotspots, output);
+        aurora_jobs.wait();
     }
 
 
-    handle_particles(output.particles, input.particles, output, player);
-
+    if (!input.scenario_initialized) {
+        output.scenario->sub<ScenarioScript>().initialize(output);
+    }
+    output.scenario_initialized = true;
+}
 
-    for (const ShipState &in: input.ships) {
-        ShipState &out = output.ships[&in - input.ships.data()];
 
-        out.radar.update(in.radar, out, output, user_input);
-    }
+static fvec3 nlerp(const fvec3 &a, const fvec3 &b, float alpha)
+{
+    return (a + alpha * (b - a)).normalized();
+}
 
 
-    for (auto it = output.ships.begin(); it != output.ships.end();) {
-        if (it->hull_hitpoints <= 0.f) {
-            it = output.ships.erase(it);
-            output.ship_list_changed = true;
-        } else {
-            ++it;
+void interpolate_world_states(InterpolatedState &output,
+                              const WorldState &previous,
+                              const WorldState &current, float alpha,
+                              float real_interval)
+{
+    output.real_interval = real_interval;
+    output.interval      = current.real_interval
+                           ? real_interval * current.interval
+                             / current.real_interval
+                           : 0.f;
+
+    size_t player_slot = current.player_ship;
+    const ShipState &player = current.ships[player_slot];
+    const ShipTable &t = current.ship_table;
+
+    output.earth_mv = current.earth_mv;
+    output.position = t.position(player_slot);
+    output.velocity = t.velocity(player_slot);
+    output.forward  = t.forward(player_slot);
+    output.up       = t.up(player_slot);
+    output.right    = t.right(player_slot);
+
+    // Simulated time to go back from the current state
+    float back = 0.f;
+
+    if (alpha < 1.f) {
+        back = (1.f - alpha) * current.interval;
+
+        float earth_rotation = current.earth_angle - previous.earth_angle;
+        earth_rotation -= 2.f * M_PIf * roundf(earth_rotation / (2.f * M_PIf));
+
+        output.earth_mv = earth_matrix(previous.earth_angle
+                                       + alpha * earth_rotation);
+
+        if (previous.ship_by_id(player.id)) {
+            const ShipTable &p_t = previous.ship_table;
+            fvec3d p_pos = p_t.position(player_slot);
+            fvec3d p_vel = p_t.velocity(player_slot);
+
+            output.position = p_pos + static_cast<double>(alpha)
+                                      * (output.position - p_pos);
+            output.velocity = p_vel + static_cast<double>(alpha)
+                                      * (output.velocity - p_vel);
+
+            output.forward = nlerp(p_t.forward(player_slot), output.forward,
+                                   alpha);
+            output.up      = nlerp(p_t.up(player_slot), output.up, alpha);
+
+            output.right = output.forward.cross(output.up).normalized();
+            output.up    = output.right.cross(output.forward);
         }
     }
 
+    output.back = back;
 
-    if (global_options.aurora) {
-        if (!output.auroras.size()) {
-            output.auroras.resize(input.auroras.size());
-        }
+    fvec3d cam_pos = output.position
+                   + fmat3(output.right, output.up, -output.forward)
+                     * player.ship->cockpit_position;
 
-        for (size_t i = 0; i < output.auroras.size(); i++) {
-            output.auroras[i].step(input.auroras[i], input.aurora_hotspots, output);
-        }
+    // Particles cannot be matched up between states (their order changes
+    // whenever one expires), but they move in straight lines between steps
+    // anyway
+    const Particles &ps = current.particles;
+    const ParticleNonGraphicsData &pngd = ps.pngd;
 
-        output.aurora_hotspots.step(input.aurora_hotspots, output);
+    output.pgd.resize(ps.pgd.size());
+    for (size_t i = 0; i < pngd.size(); i++) {
+        fvec3d position(pngd.pos_x[i] - back * pngd.vel_x[i],
+                        pngd.pos_y[i] - back * pngd.vel_y[i],
+                        pngd.pos_z[i] - back * pngd.vel_z[i]);
+
+        output.pgd[i].position_relative_to_viewer = fvec3(position - cam_pos);
+        output.pgd[i].orientation = ps.pgd[i].orientation;
     }
 
+    output.igd.resize(ps.igd.size());
+    for (size_t i = 0; i < ps.ingd.size(); i++) {
+        const ImpactNonGraphicsData &ingd = ps.ingd[i];
+        ImpactGraphicsData &igd = output.igd[i];
 
-    if (!input.scenario_initialized) {
-        output.scenario->sub<ScenarioScript>().initialize(output);
+        igd = ps.igd[i];
+        igd.position_relative_to_viewer =
+            fvec3(ingd.position - back * ingd.velocity - cam_pos);
+
+        igd.lifetime += back;
+        if (igd.lifetime > igd.total_lifetime) {
+            igd.lifetime = igd.total_lifetime;
+        }
     }
-    output.scenario_initialized = true;
 }
 
 
-void WorldState::initialize(const std::string &sn)
+void WorldState::initialize(const std::string &sn,
+                            std::chrono::system_clock::time_point start)
 {
-    real_timestamp = std::chrono::system_clock::now();
-    timestamp      = std::chrono::system_clock::now();
+    timestamp = start;
+    sim_time  = 0.;
 
     time_speed_up = 1;
 
@@ -387,16 +826,106 @@ void WorldState::initialize(const std::string &sn)
     player_ship = 0;
 
     if (global_options.aurora) {
-        auroras.resize(3);
+        auroras.resize(global_options.auroras);
     }
 }
 
 
 ShipState &WorldState::spawn_ship(const Ship *type)
 {
-    ships.emplace_back(type);
-    ship_list_changed = true;
-    return ships.back();
+    uint32_t slot;
+
+    if (!free_ship_slots.empty()) {
+        slot = free_ship_slots.back();
+        free_ship_slots.pop_back();
+
+        uint32_t generation = ship_id_generation(ships[slot].id) + 1;
+        ships[slot] = ShipState(type, make_ship_id(slot, generation));
+        ship_equipment[slot] = ShipEquipment(type);
+        radars[slot] = Radar();
+    } else {
+        slot = ships.size();
+        ships.emplace_back(type, make_ship_id(slot, 0));
+        ship_equipment.emplace_back(type);
+        radars.emplace_back();
+        ship_table.resize(ships.size());
+    }
+
+    ship_table.set_position(slot, fvec3d::zero());
+    ship_table.set_velocity(slot, fvec3d::zero());
+    ship_table.set_angular_momentum(slot, fvec3::zero());
+    ship_table.set_orientation(slot, fvec3(0.f, 0.f, -1.f),
+                               fvec3(0.f, 1.f, 0.f), fvec3(1.f, 0.f, 0.f));
+
+    ship_list_generation++;
+    return ships[slot];
+}
+
+
+void WorldState::despawn_ship(size_t slot)
+{
+    ships[slot].alive = false;
+    free_ship_slots.push_back(slot);
+
+    ship_list_generation++;
+}
+
+
+ShipState *WorldState::ship_by_id(uint64_t id)
+{
+    uint32_t slot = ship_id_slot(id);
+
+    if (slot >= ships.size() || !ships[slot].alive || ships[slot].id != id) {
+        return nullptr;
+    }
+    return &ships[slot];
+}
+
+
+const ShipState *WorldState::ship_by_id(uint64_t id) const
+{
+    return const_cast<WorldState *>(this)->ship_by_id(id);
+}
+
+
+void WorldState::sync_ship_layout(const WorldState &input)
+{
+    if (ship_list_generation == input.ship_list_generation) {
+        return;
+    }
+
+    // Slots are never removed, so there cannot be more than in any later state
+    size_t common = std::min(ships.size(), input.ships.size());
+    if (ships.size() > common) {
+        ships.erase(ships.begin() + common, ships.end());
+        ship_equipment.erase(ship_equipment.begin() + common,
+                             ship_equipment.end());
+    }
+
+    ship_table.resize(input.ships.size());
+    radars.resize(input.ships.size());
+
+    for (size_t i = 0; i < common; i++) {
+        if (ships[i].id != input.ships[i].id ||
+            ships[i].alive != input.ships[i].alive)
+        {
+            ships[i] = input.ships[i];
+            ship_equipment[i] = input.ship_equipment[i];
+            radars[i] = input.radars[i];
+            ship_table.copy_state(i, input.ship_table);
+        }
+    }
+
+    for (size_t i = common; i < input.ships.size(); i++) {
+        ships.push_back(input.ships[i]);
+        ship_equipment.push_back(input.ship_equipment[i]);
+        radars[i] = input.radars[i];
+        ship_table.copy_state(i, input.ship_table);
+    }
+
+    free_ship_slots = input.free_ship_slots;
+    player_ship = input.player_ship;
+    ship_list_generation = input.ship_list_generation;
 }
 
 
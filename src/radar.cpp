@@ -1,41 +1,245 @@
 #include <dake/math/fmatrix.hpp>
 
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
 #include <cstdint>
 #include <climits>
+#include <unordered_map>
 #include <vector>
 
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
+#include "align-allocator.hpp"
 #include "physics.hpp"
 #include "radar.hpp"
+#include "runge-kutta-4.hpp"
 #include "ship.hpp"
+#include "spatial_grid.hpp"
 #include "ui.hpp"
 
 
 using namespace dake::math;
 
 
+// Azimuth of @rel_pos around the up axis of a ship pointing towards @forward,
+// as a fraction of a full turn (starting straight ahead, turning right)
+static float sweep_azimuth(const fvec3 &rel_pos, const fvec3 &forward,
+                           const fvec3 &right)
+{
+    float a = atan2f(rel_pos.dot(right), rel_pos.dot(forward))
+              / static_cast<float>(2. * M_PI);
+
+    return a < 0.f ? a + 1.f : a;
+}
+
+
+// Ships that might be visible, as structure of arrays
+struct ContactBatch {
+    void clear(void)
+    {
+        x.clear(); y.clear(); z.clear(); ship.clear();
+    }
+
+    void push_back(const fvec3 &rel_pos, uint32_t ship_index)
+    {
+        x.push_back(rel_pos.x());
+        y.push_back(rel_pos.y());
+        z.push_back(rel_pos.z());
+        ship.push_back(ship_index);
+    }
+
+    // Relative to the radar
+    AlignedVector<float> x, y, z;
+    AlignedVector<uint32_t> ship;
+
+    // Output of visibility_test()
+    AlignedVector<uint8_t> visible;
+};
+
+
+// Sets b.visible[i] to 1 if contact i is in range of a radar at @position and
+// the line of sight to it does not pass through the earth, or 0 otherwise
+static void visibility_test(ContactBatch &b, const fvec3d &position)
+{
+    size_t count = b.ship.size(), i = 0;
+    b.visible.resize(count);
+
+    // With d being the contact relative to the radar at P, the point on the
+    // line of sight nearest to the earth's center is at t = -(P*d) / (d*d).
+    // If that is on the segment, its squared distance from the center is
+    // P*P - (P*d)^2 / (d*d).  (If t is outside of the segment, the nearest
+    // point is one of the ends, which are above ground.)
+    float px = position.x(), py = position.y(), pz = position.z();
+    float pp = static_cast<float>(position.dot(position));
+    float earth_r2 = static_cast<float>(EARTH_RADIUS * EARTH_RADIUS);
+    float range2 = RADAR_RANGE * RADAR_RANGE;
+
+#ifdef __AVX__
+    __m256 vpx = _mm256_set1_ps(px);
+    __m256 vpy = _mm256_set1_ps(py);
+    __m256 vpz = _mm256_set1_ps(pz);
+    __m256 vpp = _mm256_set1_ps(pp);
+    __m256 vearth_r2 = _mm256_set1_ps(earth_r2);
+    __m256 vrange2 = _mm256_set1_ps(range2);
+    __m256 zero = _mm256_setzero_ps();
+
+    for (; i + 8 <= count; i += 8) {
+        __m256 dx = _mm256_loadu_ps(&b.x[i]);
+        __m256 dy = _mm256_loadu_ps(&b.y[i]);
+        __m256 dz = _mm256_loadu_ps(&b.z[i]);
+
+        __m256 dd = _mm256_add_ps(_mm256_mul_ps(dx, dx),
+                                  _mm256_add_ps(_mm256_mul_ps(dy, dy),
+                                                _mm256_mul_ps(dz, dz)));
+        __m256 pd = _mm256_add_ps(_mm256_mul_ps(vpx, dx),
+                                  _mm256_add_ps(_mm256_mul_ps(vpy, dy),
+                                                _mm256_mul_ps(vpz, dz)));
+
+        // -pd is t * dd; t > 0 and t < 1
+        __m256 on_segment = _mm256_and_ps(_mm256_cmp_ps(pd, zero, _CMP_LT_OQ),
+                                          _mm256_cmp_ps(_mm256_add_ps(pd, dd),
+                                                        zero, _CMP_GT_OQ));
+        __m256 min_dist = _mm256_sub_ps(vpp, _mm256_div_ps(_mm256_mul_ps(pd, pd),
+                                                           dd));
+        __m256 occluded = _mm256_and_ps(on_segment,
+                                        _mm256_cmp_ps(min_dist, vearth_r2,
+                                                      _CMP_LT_OQ));
+
+        int mask = _mm256_movemask_ps(
+                       _mm256_andnot_ps(occluded,
+                                        _mm256_cmp_ps(dd, vrange2,
+                                                      _CMP_LT_OQ)));
+
+        for (int j = 0; j < 8; j++) {
+            b.visible[i + j] = (mask >> j) & 1;
+        }
+    }
+#endif
+
+    for (; i < count; i++) {
+        float dd = b.x[i] * b.x[i] + b.y[i] * b.y[i] + b.z[i] * b.z[i];
+        float pd = px * b.x[i] + py * b.y[i] + pz * b.z[i];
+
+        bool occluded = pd < 0.f && pd + dd > 0.f &&
+                        pp - pd * pd / dd < earth_r2;
+
+        b.visible[i] = dd < range2 && !occluded;
+    }
+}
+
+
 void Radar::update(const Radar &radar_old, const ShipState &ship_new,
-                   const WorldState &ws_new, const Input &user_input)
+                   const WorldState &ws_new, const SpatialGrid &grid,
+                   const Input &user_input)
 {
-    selected = nullptr;
+    // Radars of different ships are updated in parallel
+    static thread_local std::vector<uint32_t> candidates;
+
+    const ShipTable &table = ws_new.ship_table;
+    size_t own_slot = ship_id_slot(ship_new.id);
+    fvec3d position = table.position(own_slot);
+    fvec3d velocity = table.velocity(own_slot);
+    fvec3 forward = table.forward(own_slot), right = table.right(own_slot);
+
+    fvec3d range(RADAR_RANGE, RADAR_RANGE, RADAR_RANGE);
+
+    candidates.clear();
+    if (grid.query(position - range, position + range, &candidates)) {
+        // Keep the targets in the order of the ship list, so cycling through
+        // them does not depend on how the grid happens to be laid out
+        std::sort(candidates.begin(), candidates.end());
+    } else {
+        for (size_t i = 0; i < ws_new.ships.size(); i++) {
+            candidates.push_back(i);
+        }
+    }
+
     selected_id = radar_old.selected_id;
 
-    size_t oi = 0;
-    for (const ShipState &ship: ws_new.ships) {
-        if (&ship == &ship_new) {
+    float interval = ws_new.interval;
+    const Ship *type = ship_new.ship;
+
+    // Fraction of a full turn the antenna covers during this step, starting
+    // from where it has been at the end of the last one
+    float sweep_length = type->has_radar_scan_rate
+                         ? type->radar_scan_rate * interval
+                         : 1.f;
+    bool full_sweep = sweep_length >= 1.f;
+
+    sweep = full_sweep ? 0.f : fmodf(radar_old.sweep + sweep_length, 1.f);
+
+    auto swept = [&](const fvec3 &rel_pos) -> bool {
+        if (full_sweep) {
+            return true;
+        }
+
+        float a = sweep_azimuth(rel_pos, forward, right) - radar_old.sweep;
+        return (a < 0.f ? a + 1.f : a) < sweep_length;
+    };
+
+    // Contacts outside of the swept sector keep their last known state; they
+    // can only be moved along their last known relative velocity
+    static thread_local std::unordered_map<uint64_t, size_t> kept_targets;
+    kept_targets.clear();
+
+    targets.clear();
+    if (!full_sweep) {
+        for (const RadarTarget &t: radar_old.targets) {
+            fvec3 rel_pos = t.relative_position + interval * t.relative_velocity;
+
+            if (!swept(rel_pos)) {
+                kept_targets[t.id] = targets.size();
+                targets.push_back(t);
+                targets.back().relative_position = rel_pos;
+            }
+        }
+    }
+
+    static thread_local ContactBatch contacts;
+    contacts.clear();
+
+    for (uint32_t ship_index: candidates) {
+        const ShipState &ship = ws_new.ships[ship_index];
+
+        if (&ship != &ship_new && ship.alive) {
+            contacts.push_back(fvec3(table.position(ship_index) - position),
+                               ship_index);
+        }
+    }
+
+    // Drops everything out of range or behind the earth before doing
+    // anything else with the contacts
+    visibility_test(contacts, position);
+
+    for (size_t i = 0; i < contacts.ship.size(); i++) {
+        if (!contacts.visible[i]) {
             continue;
         }
 
-        fvec3 rel_pos = ship.position - ship_new.position;
+        const ShipState &ship = ws_new.ships[contacts.ship[i]];
+        fvec3 rel_pos(contacts.x[i], contacts.y[i], contacts.z[i]);
 
-        // TODO: Check whether obstructed by earth
-        if (rel_pos.length() >= 1e6f) {
+        if (!swept(rel_pos)) {
             continue;
         }
 
-        if (targets.size() <= oi) {
-            targets.resize(oi + 1);
+        // The estimate may have been off, so the ship may still be among the
+        // contacts kept from the last step
+        auto kept = kept_targets.find(ship.id);
+        if (kept != kept_targets.end()) {
+            targets[kept->second].relative_position = rel_pos;
+            targets[kept->second].relative_velocity =
+                table.velocity(contacts.ship[i]) - velocity;
+            continue;
         }
-        targets[oi].relative_position = rel_pos;
+
+        targets.emplace_back();
+        RadarTarget &target = targets.back();
+
+        target.relative_position = rel_pos;
 
         // As a side note: We should *not* read anything but the position from
         // the WorldState, because in reality we'd be unable to obtain that
@@ -45,26 +249,34 @@ void Radar::update(const Radar &radar_old, const ShipState &ship_new,
         // the ones seen now. That is both hard and computationally intensive,
         // with little actual gain. So we'll just assume we have some magic way
         // of identifying the target, and that's it.
-        targets[oi].id = ship.id;
+        target.id = ship.id;
 
         // Oh, and getting the last position for actually calculating the
         // velocity as the difference is not trivial, either, as we'd have to
         // iterate through the old targets (or the full old ship list). Just
         // skip it, too.
-        targets[oi].relative_velocity = ship.velocity - ship_new.velocity;
-
-        if (ship.id == selected_id) {
-            selected = &targets[oi];
-        }
+        target.relative_velocity = table.velocity(contacts.ship[i]) - velocity;
+    }
 
-        oi++;
+    // Kept and new contacts are mixed up now; restore the order of the ship
+    // list
+    if (!full_sweep) {
+        std::sort(targets.begin(), targets.end(),
+                  [](const RadarTarget &x, const RadarTarget &y) {
+                      uint32_t xs = ship_id_slot(x.id), ys = ship_id_slot(y.id);
+                      return xs != ys ? xs < ys : x.id < y.id;
+                  });
     }
 
-    if (oi < targets.size()) {
-        targets.resize(oi);
+    // Index instead of a pointer, because targets may still be reallocated
+    ptrdiff_t selected = -1;
+    for (size_t i = 0; i < targets.size(); i++) {
+        if (targets[i].id == selected_id) {
+            selected = i;
+        }
     }
 
-    if (!selected) {
+    if (selected < 0) {
         selected_id = (uint64_t)-1;
     }
 
@@ -72,37 +284,37 @@ void Radar::update(const Radar &radar_old, const ShipState &ship_new,
         return;
     }
 
-    if (&ship_new - ws_new.ships.data() == ws_new.player_ship) {
-        if (user_input.get_mapping("next_target")) {
-            if (targets.empty()) {
-                selected = nullptr;
-            } else if (!selected || selected == &targets.back()) {
-                selected = &targets.front();
-            } else {
-                selected++;
-            }
+    ptrdiff_t target_count = targets.size();
 
-            if (selected) {
-                selected_id = selected->id;
-            } else {
-                selected_id = (uint64_t)-1;
-            }
+    if (user_input.get_mapping("next_target")) {
+        if (!target_count) {
+            selected = -1;
+        } else if (selected < 0 || selected == target_count - 1) {
+            selected = 0;
+        } else {
+            selected++;
         }
 
-        if (user_input.get_mapping("previous_target")) {
-            if (targets.empty()) {
-                selected = nullptr;
-            } else if (!selected || selected == &targets.front()) {
-                selected = &targets.back();
-            } else {
-                selected--;
-            }
+        if (selected >= 0) {
+            selected_id = targets[selected].id;
+        } else {
+            selected_id = (uint64_t)-1;
+        }
+    }
 
-            if (selected) {
-                selected_id = selected->id;
-            } else {
-                selected_id = (uint64_t)-1;
-            }
+    if (user_input.get_mapping("previous_target")) {
+        if (!target_count) {
+            selected = -1;
+        } else if (selected <= 0) {
+            selected = target_count - 1;
+        } else {
+            selected--;
+        }
+
+        if (selected >= 0) {
+            selected_id = targets[selected].id;
+        } else {
+            selected_id = (uint64_t)-1;
         }
     }
 }
@@ -1,43 +1,235 @@
 #include <dake/math/fmatrix.hpp>
 
+#include <cmath>
+#include <cstddef>
+
+#ifdef __AVX__
+#include <immintrin.h>
+#endif
+
 #include "runge-kutta-4.hpp"
 
 
 using namespace dake::math;
 
 
-struct Increments {
-    Increments(void): dx(fvec3::zero()), dv(fvec3::zero()) {}
-    Increments(const fvec3 &dxdt, const fvec3 &dvdt): dx(dxdt), dv(dvdt) {}
+#ifdef __AVX__
 
-    fvec3 dx, dv;
+struct AVXVec3 {
+    __m256d x, y, z;
 };
 
 
-static Increments evaluate(const RK4State &initial, float dt,
-                           const Increments &d,
-                           RK4CalcAccelerationFunc calc_accel)
+static inline __m256d madd(__m256d a, __m256d b, __m256d c)
+{
+    return _mm256_add_pd(_mm256_mul_pd(a, b), c);
+}
+
+
+static inline AVXVec3 madd(const AVXVec3 &a, __m256d b, const AVXVec3 &c)
+{
+    return AVXVec3{ madd(a.x, b, c.x), madd(a.y, b, c.y), madd(a.z, b, c.z) };
+}
+
+
+// Same as RK4EarthGravity, for four bodies
+static inline AVXVec3 earth_gravity(const AVXVec3 &pos, const AVXVec3 &accel)
+{
+    __m256d r2 = _mm256_add_pd(_mm256_mul_pd(pos.x, pos.x),
+                               _mm256_add_pd(_mm256_mul_pd(pos.y, pos.y),
+                                             _mm256_mul_pd(pos.z, pos.z)));
+
+    __m256d factor = _mm256_div_pd(_mm256_set1_pd(-EARTH_GM),
+                                   _mm256_mul_pd(r2, _mm256_sqrt_pd(r2)));
+
+    // Masks out the gravity below the surface (and inf/NaN for r2 == 0)
+    __m256d above = _mm256_cmp_pd(r2, _mm256_set1_pd(EARTH_RADIUS *
+                                                     EARTH_RADIUS),
+                                  _CMP_GT_OQ);
+    factor = _mm256_and_pd(factor, above);
+
+    return madd(pos, factor, accel);
+}
+
+
+static inline __m256d load_accel(const float *ptr)
+{
+    return _mm256_cvtps_pd(_mm_loadu_ps(ptr));
+}
+
+#endif
+
+
+void rk4_integrate_earth_gravity(const RK4Batch &b, size_t count, float dt)
 {
-    RK4State state(initial.x + d.dx * dt,
-                   initial.v + d.dv * dt);
+    size_t i = 0;
+
+#ifdef __AVX__
+    __m256d vdt  = _mm256_set1_pd(dt);
+    __m256d vh   = _mm256_set1_pd(.5 * dt);
+    __m256d vdt6 = _mm256_set1_pd(dt / 6.);
+    __m256d two  = _mm256_set1_pd(2.);
+
+    for (; i + 4 <= count; i += 4) {
+        AVXVec3 x = { _mm256_loadu_pd(b.pos_x + i),
+                      _mm256_loadu_pd(b.pos_y + i),
+                      _mm256_loadu_pd(b.pos_z + i) };
+        AVXVec3 v = { _mm256_loadu_pd(b.vel_x + i),
+                      _mm256_loadu_pd(b.vel_y + i),
+                      _mm256_loadu_pd(b.vel_z + i) };
+        AVXVec3 c = { load_accel(b.acc_x + i),
+                      load_accel(b.acc_y + i),
+                      load_accel(b.acc_z + i) };
+
+        // See rk4_integrate(): The velocity increments are the velocities at
+        // the intermediate points, the position increments the accelerations
+        AVXVec3 a1 = earth_gravity(x, c);
+
+        AVXVec3 v2 = madd(a1, vh, v);
+        AVXVec3 a2 = earth_gravity(madd(v, vh, x), c);
+
+        AVXVec3 v3 = madd(a2, vh, v);
+        AVXVec3 a3 = earth_gravity(madd(v2, vh, x), c);
+
+        AVXVec3 v4 = madd(a3, vdt, v);
+        AVXVec3 a4 = earth_gravity(madd(v3, vdt, x), c);
+
+        AVXVec3 dx = madd(madd(v2, two, v), _mm256_set1_pd(1.),
+                          madd(v3, two, v4));
+        AVXVec3 dv = madd(madd(a2, two, a1), _mm256_set1_pd(1.),
+                          madd(a3, two, a4));
+
+        x = madd(dx, vdt6, x);
+        v = madd(dv, vdt6, v);
+
+        _mm256_storeu_pd(b.pos_x + i, x.x);
+        _mm256_storeu_pd(b.pos_y + i, x.y);
+        _mm256_storeu_pd(b.pos_z + i, x.z);
+        _mm256_storeu_pd(b.vel_x + i, v.x);
+        _mm256_storeu_pd(b.vel_y + i, v.y);
+        _mm256_storeu_pd(b.vel_z + i, v.z);
+    }
+#endif
+
+    for (; i < count; i++) {
+        RK4EarthGravity gravity(fvec3d(b.acc_x[i], b.acc_y[i], b.acc_z[i]));
+
+        RK4State rk4s = rk4_integrate(
+            RK4State(fvec3d(b.pos_x[i], b.pos_y[i], b.pos_z[i]),
+                     fvec3d(b.vel_x[i], b.vel_y[i], b.vel_z[i])),
+            dt, gravity);
+
+        b.pos_x[i] = rk4s.x.x();
+        b.pos_y[i] = rk4s.x.y();
+        b.pos_z[i] = rk4s.x.z();
+
+        b.vel_x[i] = rk4s.v.x();
+        b.vel_y[i] = rk4s.v.y();
+        b.vel_z[i] = rk4s.v.z();
+    }
+}
+
+
+// Dormand–Prince 5(4) tableau
+static const double dp_a[7][6] = {
+    { 0. },
+    { 1. / 5. },
+    { 3. / 40., 9. / 40. },
+    { 44. / 45., -56. / 15., 32. / 9. },
+    { 19372. / 6561., -25360. / 2187., 64448. / 6561., -212. / 729. },
+    { 9017. / 3168., -355. / 33., 46732. / 5247., 49. / 176.,
+      -5103. / 18656. },
+    // Equal to the fifth-order weights, so the last stage is evaluated at the
+    // new state and can be reused as the first stage of the next substep
+    { 35. / 384., 0., 500. / 1113., 125. / 192., -2187. / 6784., 11. / 84. },
+};
+
+// Difference between the fifth- and the fourth-order weights
+static const double dp_e[7] = {
+    71. / 57600., 0., -71. / 16695., 71. / 1920., -17253. / 339200.,
+    22. / 525., -1. / 40.
+};
+
+// Relative tolerance (positions are in the order of 10^7 m) and absolute
+// tolerances for positions (m) and velocities (m/s), per substep
+#define DP_RTOL   1e-10
+#define DP_ATOL_X 1e-3
+#define DP_ATOL_V 1e-6
+
+// Prevents a single body from taking arbitrarily long; after this many
+// attempts, substeps are accepted regardless of the error
+#define DP_MAX_ATTEMPTS 1000
+
+
+static RK4State dopri5_integrate(RK4State y, double dt,
+                                 const RK4EarthGravity &calc_accel)
+{
+    RK4Increments k[7];
+    k[0] = RK4Increments(y.v, calc_accel(y));
+
+    double t = 0., h = dt;
+    int attempts = 0;
+
+    while (t < dt) {
+        bool last = h >= dt - t;
+        if (last) {
+            h = dt - t;
+        }
+
+        RK4State y_new = y;
+        for (int s = 1; s < 7; s++) {
+            fvec3d dx = fvec3d::zero(), dv = fvec3d::zero();
+            for (int j = 0; j < s; j++) {
+                dx = dx + k[j].dx * dp_a[s][j];
+                dv = dv + k[j].dv * dp_a[s][j];
+            }
+
+            y_new = RK4State(y.x + dx * h, y.v + dv * h);
+            k[s] = RK4Increments(y_new.v, calc_accel(y_new));
+        }
+
+        fvec3d err_x = fvec3d::zero(), err_v = fvec3d::zero();
+        for (int j = 0; j < 7; j++) {
+            err_x = err_x + k[j].dx * dp_e[j];
+            err_v = err_v + k[j].dv * dp_e[j];
+        }
+
+        double err = fmax(h * err_x.length() /
+                          (DP_ATOL_X + DP_RTOL * y_new.x.length()),
+                          h * err_v.length() /
+                          (DP_ATOL_V + DP_RTOL * y_new.v.length()));
+
+        if (err <= 1. || ++attempts >= DP_MAX_ATTEMPTS) {
+            y = y_new;
+            k[0] = k[6];
+
+            t = last ? dt : t + h;
+        }
+
+        double factor = err > 0. ? .9 * pow(err, -.2) : 5.;
+        h *= fmin(fmax(factor, .2), 5.);
+    }
 
-    return Increments(state.v, calc_accel(state));
+    return y;
 }
 
 
-RK4State rk4_integrate(const RK4State &initial, float dt,
-                       RK4CalcAccelerationFunc calc_accel)
+void dopri5_integrate_earth_gravity(const RK4Batch &b, size_t count, float dt)
 {
-    Increments k1, k2, k3, k4;
+    for (size_t i = 0; i < count; i++) {
+        RK4EarthGravity gravity(fvec3d(b.acc_x[i], b.acc_y[i], b.acc_z[i]));
 
-    k1 = evaluate(initial, 0.f * dt, Increments(), calc_accel);
-    k2 = evaluate(initial, .5f * dt, k1,           calc_accel);
-    k3 = evaluate(initial, .5f * dt, k2,           calc_accel);
-    k4 = evaluate(initial, 1.f * dt, k3,           calc_accel);
+        RK4State y = dopri5_integrate(
+            RK4State(fvec3d(b.pos_x[i], b.pos_y[i], b.pos_z[i]),
+                     fvec3d(b.vel_x[i], b.vel_y[i], b.vel_z[i])),
+            dt, gravity);
 
-    fvec3 dx = (k1.dx + 2.f * (k2.dx + k3.dx) + k4.dx) * (1.f / 6.f);
-    fvec3 dv = (k1.dv + 2.f * (k2.dv + k3.dv) + k4.dv) * (1.f / 6.f);
+        b.pos_x[i] = y.x.x();
+        b.pos_y[i] = y.x.y();
+        b.pos_z[i] = y.x.z();
 
-    return RK4State(initial.x + dx * dt,
-                    initial.v + dv * dt);
+        b.vel_x[i] = y.v.x();
+        b.vel_y[i] = y.v.y();
+        b.vel_z[i] = y.v.z();
+    }
 }
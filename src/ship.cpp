@@ -1,9 +1,9 @@
 #include <dake/math/fmatrix.hpp>
 
-#include <cassert>
 #include <cstdint>
 #include <cstring>
 #include <climits>
+#include <initializer_list>
 
 #include "json-structs.hpp"
 #include "ship.hpp"
@@ -12,28 +12,17 @@
 using namespace dake::math;
 
 
-static uint64_t id_counter;
-
-
-ShipState::ShipState(const Ship *ship_type):
-    ship(ship_type)
+ShipState::ShipState(const Ship *ship_type, uint64_t ship_id):
+    ship(ship_type),
+    id(ship_id),
+    alive(true)
 {
-    assert(id_counter < UINT64_MAX);
-
-    id = id_counter++;
 
-    position        = fvec3d::zero();
-    velocity        = fvec3d::zero();
     acceleration    = fvec3::zero();
 
     rotational_velocity = fvec3::zero();
-    angular_momentum    = fvec3::zero();
     torque              = fvec3::zero();
 
-    forward = fvec3(0.f, 0.f, -1.f);
-    up      = fvec3(0.f, 1.f,  0.f);
-    right   = fvec3(1.f, 0.f,  0.f);
-
     weapon_force    = fvec3::zero();
     weapon_torque   = fvec3::zero();
 
@@ -44,11 +33,6 @@ ShipState::ShipState(const Ship *ship_type):
 
     total_mass = ship->empty_mass;
 
-    thruster_states.resize(ship->thrusters.size(), 0.f);
-    weapon_cooldowns.resize(ship->weapons.size(), 0.f);
-    weapon_fired.resize(ship->weapons.size(), false);
-    weapon_forwards.resize(ship->weapons.size(), fvec3(0.f, 0.f, -1.f));
-
     hull_hitpoints = ship->hull_hitpoints;
 }
 
@@ -60,3 +44,43 @@ void ShipState::deal_damage(float amount)
         hull_hitpoints = 0.f;
     }
 }
+
+
+ShipEquipment::ShipEquipment(const Ship *ship_type)
+{
+    thruster_states.resize(ship_type->thrusters.size(), 0.f);
+    weapon_cooldowns.resize(ship_type->weapons.size(), 0.f);
+    weapon_fired.resize(ship_type->weapons.size(), false);
+    weapon_forwards.resize(ship_type->weapons.size(), fvec3(0.f, 0.f, -1.f));
+}
+
+
+void ShipTable::resize(size_t count)
+{
+    for (AlignedVector<double> *v: { &pos_x, &pos_y, &pos_z,
+                                     &vel_x, &vel_y, &vel_z })
+    {
+        v->resize(count);
+    }
+
+    for (AlignedVector<float> *v: { &ang_mom_x, &ang_mom_y, &ang_mom_z,
+                                    &fwd_x, &fwd_y, &fwd_z,
+                                    &up_x, &up_y, &up_z,
+                                    &right_x, &right_y, &right_z,
+                                    &acc_x, &acc_y, &acc_z,
+                                    &torque_x, &torque_y, &torque_z, &mass })
+    {
+        v->resize(count);
+    }
+
+    on_rails.resize(count);
+}
+
+
+void ShipTable::copy_state(size_t i, const ShipTable &other)
+{
+    set_position(i, other.position(i));
+    set_velocity(i, other.velocity(i));
+    set_angular_momentum(i, other.angular_momentum(i));
+    set_orientation(i, other.forward(i), other.up(i), other.right(i));
+}
@@ -1,3 +1,4 @@
+#include <cmath>
 #include <stdexcept>
 #include <string>
 #include <unordered_map>
@@ -15,7 +16,23 @@ static void do_load_ship_types(void)
     parse_file(&si, "config/ships/index.json");
 
     for (const std::string &name: si.types) {
-        ship_types[name] = parse_file<Ship>("config/ships/" + name + ".json");
+        Ship *ship = parse_file<Ship>("config/ships/" + name + ".json");
+
+        if (!ship->has_hitbox_radius) {
+            ship->hitbox_radius = DEFAULT_HITBOX_RADIUS;
+        }
+
+        if (ship->has_radar_scan_rate &&
+            (!std::isfinite(ship->radar_scan_rate) ||
+             ship->radar_scan_rate <= 0.f))
+        {
+            delete ship;
+            throw std::runtime_error("Invalid radar_scan_rate given for ship "
+                                     "type “" + name + "” (must be a positive "
+                                     "number)");
+        }
+
+        ship_types[name] = ship;
     }
 }
 
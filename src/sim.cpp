@@ -0,0 +1,183 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <getopt.h>
+#include <memory>
+#include <string>
+
+#include "jobs.hpp"
+#include "options.hpp"
+#include "physics.hpp"
+#include "ship_types.hpp"
+#include "software.hpp"
+#include "ui.hpp"
+#include "weapons.hpp"
+
+
+// Headless simulation runner: Runs a scenario through do_physics() for a
+// given number of steps without any window, GL context or audio and reports
+// how long each step took.
+
+
+Options global_options;
+
+
+int main(int argc, char *argv[])
+{
+    std::string scenario = "null";
+    unsigned long steps = 1000, rate = 60;
+    bool quiet = false;
+    time_t start = 1429379816; // Arbitrary, but fixed
+
+    for (;;) {
+        static const struct option options[] = {
+            {"help", no_argument, nullptr, 'h'},
+            {"scenario", required_argument, nullptr, 's'},
+            {"steps", required_argument, nullptr, 'n'},
+            {"quiet", no_argument, nullptr, 'q'},
+            {"physics-rate", required_argument, nullptr, 'r'},
+            {"start-time", required_argument, nullptr, 't'},
+            COMMON_LONG_OPTIONS,
+
+            {nullptr, 0, nullptr, 0}
+        };
+
+        int option = getopt_long(argc, argv, "hs:n:qr:t:", options, nullptr);
+        if (option == -1) {
+            break;
+        }
+
+        switch (option) {
+            case 'h':
+            case '?':
+                fprintf(stderr, "Usage: %s [options...]\n\n", argv[0]);
+                fprintf(stderr, "Options:\n");
+                fprintf(stderr, "  -h, --help       Shows this information\n");
+                fprintf(stderr, "  -s, --scenario=name\n");
+                fprintf(stderr, "                   Scenario to run (default: null)\n");
+                fprintf(stderr, "  -n, --steps=N    Number of physics steps to run (default: 1000)\n");
+                fprintf(stderr, "  -q, --quiet      Only print the summary, not every step\n");
+                fprintf(stderr, "  -r, --physics-rate=Hz\n");
+                fprintf(stderr, "                   Simulated steps per second (default: 60)\n");
+                fprintf(stderr, "  -t, --start-time=time\n");
+                fprintf(stderr, "                   In-game date to start at, as a UNIX timestamp\n");
+                print_common_options_help();
+                return 0;
+
+            case 's':
+                scenario = optarg;
+                break;
+
+            case 'n': {
+                char *endp;
+                errno = 0;
+                steps = strtoul(optarg, &endp, 0);
+                if (errno || !steps || *endp) {
+                    fprintf(stderr, "Invalid argument given for --steps\n");
+                    return 1;
+                }
+                break;
+            }
+
+            case 'q':
+                quiet = true;
+                break;
+
+            case 'r': {
+                char *endp;
+                errno = 0;
+                rate = strtoul(optarg, &endp, 0);
+                if (errno || !rate || (rate > 10000) || *endp) {
+                    fprintf(stderr, "Invalid argument given for --physics-rate (1..10000)\n");
+                    return 1;
+                }
+                break;
+            }
+
+            case 't': {
+                char *endp;
+                errno = 0;
+                start = strtoll(optarg, &endp, 0);
+                if (errno || *endp) {
+                    fprintf(stderr, "Invalid argument given for --start-time\n");
+                    return 1;
+                }
+                break;
+            }
+
+            default:
+                if (!parse_common_option(option, optarg)) {
+                    return 1;
+                }
+                break;
+        }
+    }
+
+
+    // timezones sure are awesome
+    setenv("TZ", "", 1);
+    tzset();
+
+
+    init_jobs(global_options.job_threads);
+    load_software();
+    load_ship_types();
+    load_weapons();
+
+
+    Input input;
+    std::unique_ptr<WorldState> world_states[2] = {
+        std::unique_ptr<WorldState>(new WorldState),
+        std::unique_ptr<WorldState>(new WorldState)
+    };
+
+    world_states[0]->initialize(scenario,
+                                std::chrono::system_clock::from_time_t(start));
+
+    global_options.physics_step = 1.f / rate;
+
+    double total = 0., minimum = HUGE_VAL, maximum = 0.;
+
+    for (unsigned long i = 0; i < steps; i++) {
+        WorldState &output = *world_states[(i + 1) % 2];
+        const WorldState &in = *world_states[i % 2];
+
+        auto step_begin = std::chrono::steady_clock::now();
+        do_physics(output, in, input, global_options.physics_step);
+        auto step_end = std::chrono::steady_clock::now();
+
+        double ms = std::chrono::duration_cast<std::chrono::duration<double,
+                                                                      std::milli>>
+                        (step_end - step_begin).count();
+
+        total += ms;
+        if (ms < minimum) {
+            minimum = ms;
+        }
+        if (ms > maximum) {
+            maximum = ms;
+        }
+
+        if (!quiet) {
+            printf("step %lu: %.3f ms (%zu ships, %zu particles)\n", i, ms,
+                   output.ships.size() - output.free_ship_slots.size(),
+                   output.particles.pngd.size());
+        }
+    }
+
+    printf("%lu steps (%.3f s simulated): total %.3f ms, min %.3f ms, "
+           "avg %.3f ms, max %.3f ms\n",
+           steps, world_states[steps % 2]->sim_time, total, minimum,
+           total / steps, maximum);
+
+
+    return 0;
+}
@@ -1,5 +1,6 @@
 #include <dake/dake.hpp>
 
+#include <cstdint>
 #include <dirent.h>
 #include <stdexcept>
 #include <unistd.h>
@@ -271,7 +272,9 @@ static int luaw_vec3(lua_State *ls)
 }
 
 
-void FlightControlSoftware::execute(ShipState &ship, const Input &input, float interval)
+void FlightControlSoftware::execute(ShipEquipment &equipment_out,
+                                    const ShipState &ship, const Input &input,
+                                    float interval)
 {
     lua_getglobal(ls(), "flight_control");
     if (lua_isnil(ls(), -1)) {
@@ -366,12 +369,13 @@ void FlightControlSoftware::execute(ShipState &ship, const Input &input, float i
         return;
     }
 
-    for (size_t i = 0; i < ship.thruster_states.size(); i++) {
+    std::vector<float> &thruster_states = equipment_out.thruster_states;
+    for (size_t i = 0; i < thruster_states.size(); i++) {
         lua_pushinteger(ls(), i);
         lua_gettable(ls(), -2);
 
         if (lua_isnumber(ls(), -1)) {
-            ship.thruster_states[i] += lua_tonumber(ls(), -1);
+            thruster_states[i] += lua_tonumber(ls(), -1);
         } else if (!lua_isnil(ls(), -1)) {
             throw std::runtime_error(enm() + ": Bad thruster state returned");
         }
@@ -397,12 +401,19 @@ int ScenarioScript::luaw_fix_player_to_ground(lua_State *ls)
 }
 
 
-static ShipState *lua_toship(lua_State *ls, int index)
+// Ships are referred to by their ID instead of a pointer, because scripts may
+// keep them around across steps (and thus world states)
+static ShipState *lua_toship(lua_State *ls, WorldState *ws, int index)
 {
     lua_getfield(ls, index, "id");
-    ShipState *ship = static_cast<ShipState *>(lua_touserdata(ls, -1));
+    uint64_t id = reinterpret_cast<uintptr_t>(lua_touserdata(ls, -1));
     lua_pop(ls, 1);
 
+    ShipState *ship = ws->ship_by_id(id);
+    if (!ship) {
+        throw std::runtime_error("Ship does not exist (anymore)");
+    }
+
     return ship;
 }
 
@@ -411,17 +422,20 @@ int ScenarioScript::luaw_set_ship_position(lua_State *ls)
 {
     ScenarioScript *ss =
         static_cast<ScenarioScript *>(lua_touserdata(ls, lua_upvalueindex(1)));
-    ShipState *ship = lua_toship(ls, 1);
+    ShipState *ship = lua_toship(ls, ss->current_world_state, 1);
     float lng = lua_tonumber(ls, 2) - M_PIf / 2.f;
     float lat = lua_tonumber(ls, 3);
     double height = lua_tonumber(ls, 4);
 
-    ship->position = ss->current_world_state->earth_mv
-                     * fvec4(cosf(lat) * sinf(lng),
-                             sinf(lat),
-                             cosf(lat) * cosf(lng),
-                             1.f);
-    ship->position += height * ship->position.normalized();
+    fvec3d position = ss->current_world_state->earth_mv
+                      * fvec4(cosf(lat) * sinf(lng),
+                              sinf(lat),
+                              cosf(lat) * cosf(lng),
+                              1.f);
+    position += height * position.normalized();
+
+    ss->current_world_state->ship_table.set_position(ship_id_slot(ship->id),
+                                                     position);
 
     return 0;
 }
@@ -429,11 +443,17 @@ int ScenarioScript::luaw_set_ship_position(lua_State *ls)
 
 int ScenarioScript::luaw_set_ship_velocity(lua_State *ls)
 {
-    ShipState *ship = lua_toship(ls, 1);
+    ScenarioScript *ss =
+        static_cast<ScenarioScript *>(lua_touserdata(ls, lua_upvalueindex(1)));
+    ShipState *ship = lua_toship(ls, ss->current_world_state, 1);
+    ShipTable &t = ss->current_world_state->ship_table;
+    size_t slot = ship_id_slot(ship->id);
+
+    fvec3d velocity = t.right(slot)   * lua_tonumber(ls, 2)
+                    + t.up(slot)      * lua_tonumber(ls, 3)
+                    + t.forward(slot) * lua_tonumber(ls, 4);
 
-    ship->velocity = ship->right   * lua_tonumber(ls, 2)
-                   + ship->up      * lua_tonumber(ls, 3)
-                   + ship->forward * lua_tonumber(ls, 4);
+    t.set_velocity(slot, velocity);
 
     return 0;
 }
@@ -443,25 +463,34 @@ int ScenarioScript::luaw_set_ship_bearing(lua_State *ls)
 {
     ScenarioScript *ss =
         static_cast<ScenarioScript *>(lua_touserdata(ls, lua_upvalueindex(1)));
-    ShipState *ship = lua_toship(ls, 1);
+    ShipState *ship = lua_toship(ls, ss->current_world_state, 1);
+    ShipTable &t = ss->current_world_state->ship_table;
+    size_t slot = ship_id_slot(ship->id);
+    fvec3d position = t.position(slot);
     fvec3 tangent = crossp(fvec3(ss->current_world_state->earth_mv
                                  * fvec4(0.f, 1.f, 0.f, 0.f)),
-                           fvec3(ship->position)).normalized();
+                           fvec3(position)).normalized();
 
-    ship->up      = ship->position.normalized();
-    ship->forward = fmat4::rotation_normalized(lua_tonumber(ls, 2), ship->up)
-                    * fvec4::direction(tangent);
-    ship->right   = crossp(ship->forward, ship->up);
+    fvec3 up(position.normalized());
+    fvec3 forward(fmat4::rotation_normalized(lua_tonumber(ls, 2), up)
+                  * fvec4::direction(tangent));
+    fvec3 right(crossp(forward, up));
+
+    t.set_orientation(slot, forward, up, right);
 
     return 0;
 }
 
 
-void ScenarioScript::lua_pushship(ShipState *ship)
+void ScenarioScript::lua_pushship(const ShipState *ship)
 {
+    static_assert(sizeof(uintptr_t) >= sizeof(ship->id),
+                  "Ship IDs must fit into a light userdata");
+
     lua_newtable(ls());
 
-    lua_pushlightuserdata(ls(), ship);
+    lua_pushlightuserdata(ls(), reinterpret_cast<void *>(
+                                    static_cast<uintptr_t>(ship->id)));
     lua_setfield(ls(), -2, "id");
 
     lua_pushlightuserdata(ls(), this);
@@ -538,8 +567,13 @@ void ScenarioScript::execute(WorldState &out_state, const WorldState &in_state,
 {
     (void)input;
 
-    ShipState &ops = out_state.ships[out_state.player_ship];
-    const ShipState &ips = in_state.ships[in_state.player_ship];
+    // The player ship keeps its slot (and thus its place in the ship table)
+    size_t player_slot = out_state.player_ship;
+    const ShipTable &in_t = in_state.ship_table;
+    fvec3d ipos = in_t.position(player_slot);
+    fvec3d ivel = in_t.velocity(player_slot);
+    fvec3d iup = in_t.up(player_slot), ifwd = in_t.forward(player_slot);
+    fvec3d irgt = in_t.right(player_slot);
 
     lua_getglobal(ls(), "step");
 
@@ -548,8 +582,8 @@ void ScenarioScript::execute(WorldState &out_state, const WorldState &in_state,
     lua_newtable(ls());
 
     struct cvecval { const char *name; const fvec3d &v; };
-    for (const auto &vec: (cvecval[]){ { "velocity", ips.velocity }, { "position", ips.position },
-                                       { "up", ips.up }, { "forward", ips.forward }, { "right", ips.right } })
+    for (const auto &vec: (cvecval[]){ { "velocity", ivel }, { "position", ipos },
+                                       { "up", iup }, { "forward", ifwd }, { "right", irgt } })
     {
         lua_pushvector(ls(), vec.v);
         lua_setfield(ls(), -2, vec.name);
@@ -564,9 +598,9 @@ void ScenarioScript::execute(WorldState &out_state, const WorldState &in_state,
         return;
     }
 
-    fvec3d ovel, oup, ofwd, orgt;
+    fvec3d opos, ovel, oup, ofwd, orgt;
     struct vecval { const char *name; fvec3d &v; };
-    for (const auto &vec: (vecval[]){ { "velocity", ovel }, { "position", ops.position },
+    for (const auto &vec: (vecval[]){ { "velocity", ovel }, { "position", opos },
                                       { "up", oup }, { "forward", ofwd }, { "right", orgt } })
     {
         lua_getfield(ls(), -1, vec.name);
@@ -582,10 +616,10 @@ void ScenarioScript::execute(WorldState &out_state, const WorldState &in_state,
         orgt = crossp(ofwd, oup);
     }
 
-    ops.velocity = ovel;
-    ops.forward  = ofwd;
-    ops.right    = orgt;
-    ops.up       = oup;
+    out_state.ship_table.set_position(player_slot, opos);
+    out_state.ship_table.set_velocity(player_slot, ovel);
+    out_state.ship_table.set_orientation(player_slot, fvec3(ofwd), fvec3(oup),
+                                         fvec3(orgt));
 
     lua_pop(ls(), 1);
 }
@@ -632,13 +666,17 @@ void load_software(void)
 }
 
 
-void execute_flight_control_software(ShipState &ship, const Input &input, float interval)
+void execute_flight_control_software(ShipEquipment &equipment_out,
+                                     const ShipState &ship_in,
+                                     const Input &input, float interval)
 {
-    memset(ship.thruster_states.data(), 0,
-           sizeof(ship.thruster_states[0]) * ship.thruster_states.size());
+    memset(equipment_out.thruster_states.data(), 0,
+           sizeof(equipment_out.thruster_states[0]) *
+           equipment_out.thruster_states.size());
 
     for (Software *s: software[Software::FLIGHT_CONTROL]) {
-        s->sub<FlightControlSoftware>().execute(ship, input, interval);
+        s->sub<FlightControlSoftware>().execute(equipment_out, ship_in, input,
+                                                interval);
     }
 }
 
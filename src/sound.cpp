@@ -39,10 +39,11 @@ static SoundEffect &get_sfx(const std::string &name)
 void do_sound(const WorldState &input)
 {
     const ShipState &ps = input.ships[input.player_ship];
+    const ShipEquipment &eq = input.ship_equipment[input.player_ship];
 
-    int weapon_count = ps.weapon_fired.size();
+    int weapon_count = eq.weapon_fired.size();
     for (int i = 0; i < weapon_count; i++) {
-        if (ps.weapon_fired[i]) {
+        if (eq.weapon_fired[i]) {
             const WeaponClass *wc = weapon_classes[ps.ship->weapons[i].type];
             get_sfx(wc->sound_file).play();
         }
@@ -0,0 +1,186 @@
+#include <dake/math/fmatrix.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "ship.hpp"
+#include "spatial_grid.hpp"
+
+
+using namespace dake::math;
+
+
+#define EMPTY_CELL UINT64_MAX
+
+
+// 21 bits per coordinate; cells that are 2^21 cells apart share a key, which
+// only results in some more candidates
+static uint64_t cell_key(int64_t x, int64_t y, int64_t z)
+{
+    return  (static_cast<uint64_t>(x) & 0x1fffff)
+         | ((static_cast<uint64_t>(y) & 0x1fffff) << 21)
+         | ((static_cast<uint64_t>(z) & 0x1fffff) << 42);
+}
+
+
+static inline size_t cell_hash(uint64_t key, unsigned shift)
+{
+    return (key * UINT64_C(0x9e3779b97f4a7c15)) >> shift;
+}
+
+
+int64_t SpatialGrid::cell_coord(double x) const
+{
+    return static_cast<int64_t>(floor(x / cell_sz));
+}
+
+
+void SpatialGrid::build(const AlignedVector<ShipState> &ships,
+                        const ShipTable &table, double cell_size)
+{
+    cell_sz = cell_size;
+
+    entries.clear();
+    for (size_t i = 0; i < ships.size(); i++) {
+        if (!ships[i].alive) {
+            continue;
+        }
+
+        fvec3d pos = table.position(i);
+        entries.emplace_back(cell_key(cell_coord(pos.x()), cell_coord(pos.y()),
+                                      cell_coord(pos.z())),
+                             i);
+    }
+
+    std::sort(entries.begin(), entries.end());
+
+    // At least twice as many buckets as there may be cells
+    size_t bucket_count = 16;
+    cell_shift = 60;
+    while (bucket_count < 2 * entries.size()) {
+        bucket_count *= 2;
+        cell_shift--;
+    }
+
+    cells.assign(bucket_count, Cell{EMPTY_CELL, 0, 0});
+    ship_indices.resize(entries.size());
+
+    for (size_t i = 0; i < entries.size();) {
+        uint64_t key = entries[i].first;
+        size_t begin = i;
+
+        for (; i < entries.size() && entries[i].first == key; i++) {
+            ship_indices[i] = entries[i].second;
+        }
+
+        size_t bucket = cell_hash(key, cell_shift);
+        while (cells[bucket].key != EMPTY_CELL) {
+            bucket = (bucket + 1) & (bucket_count - 1);
+        }
+
+        cells[bucket] = Cell{key, static_cast<uint32_t>(begin),
+                             static_cast<uint32_t>(i)};
+    }
+}
+
+
+const SpatialGrid::Cell *SpatialGrid::find(uint64_t key) const
+{
+    size_t bucket = cell_hash(key, cell_shift);
+
+    while (cells[bucket].key != EMPTY_CELL) {
+        if (cells[bucket].key == key) {
+            return &cells[bucket];
+        }
+        bucket = (bucket + 1) & (cells.size() - 1);
+    }
+
+    return nullptr;
+}
+
+
+// Appends the ships of all cells in [@x0, @x1] x [@y0, @y1] x [@z0, @z1]
+void SpatialGrid::collect(int64_t x0, int64_t x1, int64_t y0, int64_t y1,
+                          int64_t z0, int64_t z1,
+                          std::vector<uint32_t> *result) const
+{
+    if (entries.empty()) {
+        return;
+    }
+
+    for (int64_t x = x0; x <= x1; x++) {
+        for (int64_t y = y0; y <= y1; y++) {
+            for (int64_t z = z0; z <= z1; z++) {
+                const Cell *cell = find(cell_key(x, y, z));
+                if (cell) {
+                    result->insert(result->end(),
+                                   ship_indices.begin() + cell->begin,
+                                   ship_indices.begin() + cell->end);
+                }
+            }
+        }
+    }
+}
+
+
+bool SpatialGrid::query(const fvec3d &min, const fvec3d &max,
+                        std::vector<uint32_t> *result, size_t max_cells) const
+{
+    int64_t x0 = cell_coord(min.x()), x1 = cell_coord(max.x());
+    int64_t y0 = cell_coord(min.y()), y1 = cell_coord(max.y());
+    int64_t z0 = cell_coord(min.z()), z1 = cell_coord(max.z());
+
+    // Compare in double so huge boxes do not overflow
+    if (static_cast<double>(x1 - x0 + 1) * (y1 - y0 + 1) * (z1 - z0 + 1)
+        > max_cells)
+    {
+        return false;
+    }
+
+    collect(x0, x1, y0, y1, z0, z1, result);
+    return true;
+}
+
+
+void SpatialGrid::query_segment(const fvec3d &p0, const fvec3d &p1,
+                                double radius,
+                                std::vector<uint32_t> *result) const
+{
+    fvec3d d = p1 - p0;
+
+    // No piece is longer than a cell, so (with the radius being at most half
+    // a cell) each one's box covers at most three cells along every axis
+    size_t pieces = static_cast<size_t>(ceil(d.length() / cell_sz));
+    if (pieces < 1) {
+        pieces = 1;
+    }
+
+    size_t first = result->size();
+
+    fvec3d a = p0;
+    for (size_t i = 1; i <= pieces; i++) {
+        fvec3d b = i == pieces
+                 ? p1
+                 : p0 + static_cast<double>(i) / pieces * d;
+
+        collect(cell_coord(std::min(a.x(), b.x()) - radius),
+                cell_coord(std::max(a.x(), b.x()) + radius),
+                cell_coord(std::min(a.y(), b.y()) - radius),
+                cell_coord(std::max(a.y(), b.y()) + radius),
+                cell_coord(std::min(a.z(), b.z()) - radius),
+                cell_coord(std::max(a.z(), b.z()) + radius),
+                result);
+
+        a = b;
+    }
+
+    // Neighboring pieces overlap, so they may have found the same ships
+    if (pieces > 1) {
+        std::sort(result->begin() + first, result->end());
+        result->erase(std::unique(result->begin() + first, result->end()),
+                      result->end());
+    }
+}
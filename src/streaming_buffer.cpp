@@ -0,0 +1,241 @@
+#include <dake/gl.hpp>
+#include <epoxy/gl.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+#include "streaming_buffer.hpp"
+
+
+static std::vector<StreamingBuffer *> streaming_buffers;
+
+
+StreamingBuffer::StreamingBuffer(size_t elem_size, size_t initial_capacity):
+    element_size(elem_size),
+    slot_capacity(0)
+{
+    persistent = epoxy_gl_version() >= 44 ||
+                 epoxy_has_gl_extension("GL_ARB_buffer_storage");
+
+    glGenVertexArrays(1, &vao);
+    allocate(std::max(initial_capacity, static_cast<size_t>(1)));
+
+    streaming_buffers.push_back(this);
+}
+
+
+StreamingBuffer::~StreamingBuffer(void)
+{
+    streaming_buffers.erase(std::find(streaming_buffers.begin(),
+                                      streaming_buffers.end(), this));
+
+    for (GLsync &fence: fences) {
+        if (fence) {
+            glDeleteSync(fence);
+        }
+    }
+
+    if (mapping) {
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    glDeleteBuffers(1, &buffer);
+    glDeleteVertexArrays(1, &vao);
+}
+
+
+// Replaces the buffer by one with @capacity vertices per slot, keeping what has
+// been written to the current slot so far
+void StreamingBuffer::allocate(size_t capacity)
+{
+    GLuint old_buffer = buffer;
+    size_t old_capacity = slot_capacity;
+    size_t total = capacity * STREAMING_BUFFER_SLOTS * element_size;
+
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+    if (persistent) {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT |
+                           GL_MAP_COHERENT_BIT;
+
+        glBufferStorage(GL_ARRAY_BUFFER, total, nullptr, flags);
+        mapping = glMapBufferRange(GL_ARRAY_BUFFER, 0, total, flags);
+
+        if (!mapping) {
+            throw std::runtime_error("Failed to map streaming buffer");
+        }
+    } else {
+        glBufferData(GL_ARRAY_BUFFER, total, nullptr, GL_STREAM_DRAW);
+    }
+
+    if (old_buffer) {
+        if (slot_used) {
+            glBindBuffer(GL_COPY_READ_BUFFER, old_buffer);
+            glCopyBufferSubData(GL_COPY_READ_BUFFER, GL_ARRAY_BUFFER,
+                                slot * old_capacity * element_size,
+                                slot * capacity * element_size,
+                                slot_used * element_size);
+            glBindBuffer(GL_COPY_READ_BUFFER, 0);
+        }
+
+        // The GL keeps the storage around until all commands using it are
+        // done, so there is no need to wait for anything here
+        glDeleteBuffers(1, &old_buffer);
+
+        // Everything in the new buffer is free (except for what has just been
+        // copied, but that is the current slot anyway)
+        for (GLsync &fence: fences) {
+            if (fence) {
+                glDeleteSync(fence);
+                fence = nullptr;
+            }
+        }
+    }
+
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    slot_capacity = capacity;
+
+    // Point the attributes to the new buffer
+    for (const Attrib &a: attribs) {
+        attrib(a.index, a.components, a.type, a.offset);
+    }
+}
+
+
+void StreamingBuffer::attrib(GLuint index, int components, GLenum type,
+                             size_t offset)
+{
+    bool known = false;
+    for (const Attrib &a: attribs) {
+        known |= a.index == index;
+    }
+    if (!known) {
+        attribs.push_back(Attrib{index, components, type, offset});
+    }
+
+    glBindVertexArray(vao);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+
+    const void *ptr = reinterpret_cast<const void *>(offset);
+
+    switch (type) {
+        case GL_BYTE:  case GL_UNSIGNED_BYTE:
+        case GL_SHORT: case GL_UNSIGNED_SHORT:
+        case GL_INT:   case GL_UNSIGNED_INT:
+            glVertexAttribIPointer(index, components, type, element_size, ptr);
+            break;
+
+        default:
+            glVertexAttribPointer(index, components, type, GL_FALSE,
+                                  element_size, ptr);
+    }
+    glEnableVertexAttribArray(index);
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+
+void *StreamingBuffer::map(size_t max_count)
+{
+    if (slot_used + max_count > slot_capacity) {
+        size_t capacity = slot_capacity;
+        while (capacity < slot_used + max_count) {
+            capacity *= 2;
+        }
+
+        allocate(capacity);
+    }
+
+    size_t offset = (slot * slot_capacity + slot_used) * element_size;
+
+    if (persistent) {
+        return static_cast<uint8_t *>(mapping) + offset;
+    }
+
+    // Nothing may be using this range since the buffer has last been orphaned
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    void *ptr = glMapBufferRange(GL_ARRAY_BUFFER, offset,
+                                 max_count * element_size,
+                                 GL_MAP_WRITE_BIT |
+                                 GL_MAP_INVALIDATE_RANGE_BIT |
+                                 GL_MAP_UNSYNCHRONIZED_BIT);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    if (!ptr) {
+        throw std::runtime_error("Failed to map streaming buffer");
+    }
+
+    return ptr;
+}
+
+
+size_t StreamingBuffer::unmap(size_t count)
+{
+    if (!persistent) {
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        glUnmapBuffer(GL_ARRAY_BUFFER);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // Relative to the slot, so it stays valid if the buffer is reallocated
+    size_t first = slot_used;
+    slot_used += count;
+
+    return first;
+}
+
+
+void StreamingBuffer::draw(GLenum mode, size_t first, size_t count)
+{
+    glBindVertexArray(vao);
+    glDrawArrays(mode, slot * slot_capacity + first, count);
+    glBindVertexArray(0);
+}
+
+
+void StreamingBuffer::next_slot(void)
+{
+    if (persistent) {
+        fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    slot = (slot + 1) % STREAMING_BUFFER_SLOTS;
+    slot_used = 0;
+
+    if (persistent) {
+        if (fences[slot]) {
+            // Only blocks if the GPU is more than STREAMING_BUFFER_SLOTS
+            // frames behind
+            while (glClientWaitSync(fences[slot], GL_SYNC_FLUSH_COMMANDS_BIT,
+                                    1000000000) == GL_TIMEOUT_EXPIRED);
+
+            glDeleteSync(fences[slot]);
+            fences[slot] = nullptr;
+        }
+    } else if (!slot) {
+        glBindBuffer(GL_ARRAY_BUFFER, buffer);
+        glBufferData(GL_ARRAY_BUFFER,
+                     slot_capacity * STREAMING_BUFFER_SLOTS * element_size,
+                     nullptr, GL_STREAM_DRAW);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+}
+
+
+void StreamingBuffer::end_frame(void)
+{
+    for (StreamingBuffer *sb: streaming_buffers) {
+        // Buffers not used in this frame can just keep their slot
+        if (sb->slot_used) {
+            sb->next_slot();
+        }
+    }
+}
@@ -0,0 +1,93 @@
+#include <dake/math/fmatrix.hpp>
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "ship.hpp"
+#include "sweep_and_prune.hpp"
+
+
+using namespace dake::math;
+
+
+#define NO_SHIP UINT64_MAX
+
+
+void SweepAndPrune::sync(const AlignedVector<ShipState> &ships)
+{
+    // Drop the entries of ships that are gone (or whose slot has been reused
+    // since)
+    size_t out_i = 0;
+    for (const Entry &e: entries) {
+        if (e.ship < ships.size() && ships[e.ship].alive &&
+            ships[e.ship].id == listed_ids[e.ship])
+        {
+            entries[out_i++] = e;
+        } else {
+            listed_ids[e.ship] = NO_SHIP;
+        }
+    }
+    entries.resize(out_i);
+
+    listed_ids.resize(ships.size(), NO_SHIP);
+
+    // New ships go to the end; update() sorts them into place
+    for (size_t i = 0; i < ships.size(); i++) {
+        if (ships[i].alive && listed_ids[i] != ships[i].id) {
+            entries.push_back(Entry{0., 0., static_cast<uint32_t>(i)});
+            listed_ids[i] = ships[i].id;
+        }
+    }
+}
+
+
+void SweepAndPrune::update(const AlignedVector<ShipState> &ships,
+                           const ShipTable &table,
+                           std::vector<std::pair<uint32_t, uint32_t>> *pairs)
+{
+    sync(ships);
+
+    for (Entry &e: entries) {
+        float radius = ships[e.ship].ship->hitbox_radius;
+
+        e.min = table.pos_x[e.ship] - radius;
+        e.max = table.pos_x[e.ship] + radius;
+    }
+
+    // Insertion sort, as most entries are still in order from the last step
+    for (size_t i = 1; i < entries.size(); i++) {
+        Entry e = entries[i];
+
+        size_t j = i;
+        for (; j > 0 && entries[j - 1].min > e.min; j--) {
+            entries[j] = entries[j - 1];
+        }
+        entries[j] = e;
+    }
+
+    // Every entry can only overlap the ones after it up to the first one that
+    // starts behind its end
+    for (size_t i = 0; i < entries.size(); i++) {
+        uint32_t a = entries[i].ship;
+
+        for (size_t j = i + 1;
+             j < entries.size() && entries[j].min <= entries[i].max; j++)
+        {
+            uint32_t b = entries[j].ship;
+            double r = ships[a].ship->hitbox_radius
+                     + ships[b].ship->hitbox_radius;
+
+            if (fabs(table.pos_y[a] - table.pos_y[b]) > r ||
+                fabs(table.pos_z[a] - table.pos_z[b]) > r)
+            {
+                continue;
+            }
+
+            pairs->emplace_back(std::min(a, b), std::max(a, b));
+        }
+    }
+}
@@ -5,6 +5,7 @@
 #include <vector>
 
 #include "localize.hpp"
+#include "streaming_buffer.hpp"
 #include "text.hpp"
 
 
@@ -12,7 +13,7 @@ using namespace dake;
 using namespace dake::math;
 
 
-static gl::vertex_array *char_va;
+static StreamingBuffer *char_va;
 static gl::program *char_prg;
 static gl::texture *font[LOCALIZATIONS];
 static fvec2 font_fr[LOCALIZATIONS];
@@ -23,10 +24,12 @@ struct CharVAElement {
     unsigned chr;
 };
 
+// Only the characters change, the positions are always the same
+static fvec2 char_positions[320];
+
 
 void init_text(void)
 {
-    CharVAElement *cvad = new CharVAElement[320];
     for (int i = 0; i < 320; i++) {
         float ysign = (i % 10 >= 5) ? -1.f : 1.f;
         int m = i % 5;
@@ -37,17 +40,13 @@ void init_text(void)
 
         ysign = (m < 2) ? -ysign : ysign;
 
-        cvad[i].pos = fvec2(i / 5 + (m % 2) * .9999f, ysign * .5f);
+        char_positions[i] = fvec2(i / 5 + (m % 2) * .9999f, ysign * .5f);
     }
 
-    char_va = new gl::vertex_array;
-
-    char_va->attrib(0)->format(2);
-    char_va->attrib(0)->data(cvad, 320 * sizeof(CharVAElement), GL_DYNAMIC_DRAW, false);
-    char_va->attrib(0)->load(sizeof(CharVAElement), offsetof(CharVAElement, pos));
+    char_va = new StreamingBuffer(sizeof(CharVAElement), 320);
 
-    char_va->attrib(1)->format(1, GL_UNSIGNED_INT);
-    char_va->attrib(1)->reuse_buffer(char_va->attrib(0));
+    char_va->attrib(0, 2, GL_FLOAT, offsetof(CharVAElement, pos));
+    char_va->attrib(1, 1, GL_UNSIGNED_INT, offsetof(CharVAElement, chr));
 
 
     char_prg = new gl::program {gl::shader::vert("shaders/char_vert.glsl"),
@@ -117,15 +116,16 @@ void draw_text(const fvec2 &pos, const fvec2 &size, const std::string &text,
         throw std::invalid_argument("Text is too long");
     }
 
-    CharVAElement *cvad = static_cast<CharVAElement *>(char_va->attrib(0)->map());
+    int vertex_count = static_cast<int>(tt.size()) * 5;
+
+    CharVAElement *cvad = static_cast<CharVAElement *>(char_va->map(vertex_count));
     for (int i = 0; i < static_cast<int>(tt.size()); i++) {
         for (int j = 0; j < 5; j++) {
+            cvad[i * 5 + j].pos = char_positions[i * 5 + j];
             cvad[i * 5 + j].chr = tt[i];
         }
     }
-    char_va->attrib(0)->unmap();
-
-    char_va->attrib(1)->load(sizeof(CharVAElement), offsetof(CharVAElement, chr));
+    size_t first = char_va->unmap(vertex_count);
 
     fvec2 position = pos;
     switch (halign) {
@@ -155,6 +155,5 @@ void draw_text(const fvec2 &pos, const fvec2 &size, const std::string &text,
     char_prg->uniform<fvec2>("char_size") = size;
     char_prg->uniform<fvec2>("font_char_fill_ratio") = font_fr[olo];
 
-    char_va->set_elements(tt.size() * 5);
-    char_va->draw(GL_TRIANGLE_STRIP);
+    char_va->draw(GL_TRIANGLE_STRIP, first, vertex_count);
 }
@@ -15,6 +15,7 @@
 #include "main_loop.hpp"
 #include "physics.hpp"
 #include "sound.hpp"
+#include "streaming_buffer.hpp"
 #include "ui.hpp"
 
 #ifdef HAS_HIDAPI
@@ -1093,18 +1094,9 @@ void ui_process_menu_events(bool &quit, bool &mouse_down,
 
 void ui_swap_buffers(void)
 {
-    SDL_GL_SwapWindow(wnd);
-}
+    StreamingBuffer::end_frame();
 
-
-float Input::get_mapping(const std::string &n) const
-{
-    auto it = mapping_states.find(n);
-    if (it == mapping_states.end()) {
-        return 0.f;
-    }
-
-    return it->second;
+    SDL_GL_SwapWindow(wnd);
 }
 
 
@@ -1119,11 +1111,12 @@ void do_force_feedback(const WorldState &ws)
     //        rumble, ...)
 
     const ShipState &ps = ws.ships[ws.player_ship];
+    const ShipEquipment &eq = ws.ship_equipment[ws.player_ship];
 
     float total_thrust = 0.f;
     int thruster_count = ps.ship->thrusters.size();
     for (int i = 0; i < thruster_count; i++) {
-        total_thrust += clamp(ps.thruster_states[i]) *
+        total_thrust += clamp(eq.thruster_states[i]) *
                         ps.ship->thrusters[i].force.length();
     }
 
@@ -1131,7 +1124,7 @@ void do_force_feedback(const WorldState &ws)
     gamepad->set_right_rumble(clamp(.05f * total_thrust / ps.total_mass));
 
 
-    for (bool fired: ps.weapon_fired) {
+    for (bool fired: eq.weapon_fired) {
         if (fired) {
             gamepad->set_left_rumble(1.f, true);
             break;
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <vector>
 
 #include "serializer.hpp"
@@ -16,6 +17,22 @@ static void do_load_weapons(void)
         WeaponClass *wc = parse_file<WeaponClass>("config/weapons/" + type +
                                                   ".json");
 
+        if (!wc->has_projectile_lifetime) {
+            wc->projectile_lifetime = DEFAULT_PROJECTILE_LIFETIME;
+        }
+
+        if (!wc->has_damage) {
+            wc->damage = DEFAULT_PROJECTILE_DAMAGE;
+        }
+
+        // Projectiles leave at projectile_velocity relative to the ship, so
+        // after this time they are out of range (relative to it, at least)
+        if (wc->has_range) {
+            wc->projectile_lifetime = std::min(wc->projectile_lifetime,
+                                               wc->range /
+                                               wc->projectile_velocity);
+        }
+
         if (weapon_classes.size() <= wc->type) {
             weapon_classes.resize(wc->type + 1, nullptr);
         }